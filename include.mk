@@ -5,6 +5,11 @@ CFLAGS 	+= -MD
 CFLAGS 	+= -mcmodel=medany
 CFLAGS 	+= -ffreestanding -fno-common -nostdlib -mno-relax
 CFLAGS 	+= -I.
+# DISK=virtio builds for qemu's virt machine with a virtio disk
+DISK	?= sd
+ifeq ($(DISK), virtio)
+CFLAGS 	+= -DQEMU -DVIRTIO_DISK
+endif
 CFLAGS 	+= $(shell $(GCC) -fno-stack-protector -E -x c /dev/null >/dev/null 2>&1 && echo -fno-stack-protector)
 
 OBJDUMP := $(CROSS_COMPILE)objdump
@@ -20,4 +25,9 @@ OPTS 	+= -bios $(OPENSBI)
 
 BOARDOPTS 	= $(OPTS) -drive file=sdcard.img,if=sd,format=raw 
 QEMUOPTS 	= $(OPTS) -drive file=fs.img,if=sd,format=raw 
-#QEMUOPTS 	+= -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+ifeq ($(DISK), virtio)
+QEMUOPTS 	= -machine virt -m 1G -nographic -smp $(CPUS) -bios default
+QEMUOPTS 	+= -drive file=fs.img,if=none,format=raw,id=x0
+QEMUOPTS 	+= -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+QEMUOPTS 	+= -global virtio-mmio.force-legacy=false
+endif
@@ -0,0 +1,36 @@
+#ifndef _ASID_H_
+#define _ASID_H_
+
+#include <Type.h>
+
+// A process gets an ASID the first time it returns to user mode and
+// keeps it until the ASID space runs out. The generation then moves on,
+// each hart flushes its TLB once, and processes take new ASIDs as they
+// run again. Process.asid keeps the generation above the ASID bits, and
+// 0 means none. ASID 0 is the kernel's.
+#define ASID_GENERATION_SHIFT 16
+#define ASID_MASK ((1UL << ASID_GENERATION_SHIFT) - 1)
+
+// Collects the TLB flushes of a bulk page table update, such as fork or
+// munmap, and does them at once in tlbGatherEnd. Gathers belong to the
+// thread and may nest.
+typedef struct TlbGather {
+    struct TlbGather *prev;
+    u64 *pgdir;
+    u64 start, end;  // virtual range changed in pgdir
+    int pages;
+    bool foreign;    // another user page table changed as well
+} TlbGather;
+
+// past this many pages a whole address space is flushed instead
+#define TLB_GATHER_MAX_PAGES 32
+
+struct Process;
+void asidInit(void);
+u64 asidSatp(struct Process *p, bool *flush);
+void tlbFlushPage(u64 *pgdir, u64 va);
+void tlbGatherBegin(TlbGather *gather, u64 *pgdir);
+void tlbGatherEnd(TlbGather *gather);
+void kernelTlbSync(void);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _BLOCK_QUEUE_H_
+#define _BLOCK_QUEUE_H_
+
+#include <Type.h>
+#include <Queue.h>
+#include <Timer.h>
+
+// r_time() ticks a queued request may wait before it is served ahead of
+// the elevator order. Reads block their caller, so they expire sooner.
+#define BLOCK_READ_EXPIRE (TIMER_FREQUENCY / 20)   // 50 ms
+#define BLOCK_WRITE_EXPIRE (TIMER_FREQUENCY / 2)   // 500 ms
+
+struct BlockRequest;
+LIST_HEAD(BlockRequestList, BlockRequest);
+typedef struct BlockRequestList BlockRequestList;
+typedef LIST_ENTRY(BlockRequest) BlockRequestListEntry;
+
+// Lives on the submitter's stack until the request completes.
+typedef struct BlockRequest {
+    BlockRequestListEntry link;  // queue, sorted by sector
+    bool write;
+    u64 sector;
+    u32 count;
+    u8 **data;                   // one buffer per sector
+    u64 deadline;
+    u64 seq;                     // submission order
+    bool done;
+    int result;
+} BlockRequest;
+
+typedef struct BlockQueueStat {
+    u64 requests;    // submitted
+    u64 dispatches;  // commands sent to the driver
+    u64 merged;      // requests that rode along another one's command
+    u64 sectors;     // sectors moved
+    u64 expired;     // dispatched early because of their deadline
+    u64 depthSum;    // queue depth seen by each submitter, including itself
+    u64 depthMax;
+} BlockQueueStat;
+
+void blockQueueInit(void);
+int blockSubmit(bool write, u8 **data, u64 sector, u32 count);
+void blockQueueStat(BlockQueueStat *stat);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _DISK_H_
+#define _DISK_H_
+
+#include <Type.h>
+
+// The block device behind the buffer cache, chosen at build time:
+// the SPI SD card by default, or a virtio disk with VIRTIO_DISK.
+#ifdef VIRTIO_DISK
+#include <Virtio.h>
+
+static inline int diskInit(void) {
+    return virtioDiskInit();
+}
+
+static inline int diskRead(u8 *buf, u64 startSector, u32 sectorNumber) {
+    return virtioDiskRead(buf, startSector, sectorNumber);
+}
+
+static inline int diskReadVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+    return virtioDiskReadVector(bufs, startSector, sectorNumber);
+}
+
+static inline int diskWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
+    return virtioDiskWrite(buf, startSector, sectorNumber);
+}
+
+static inline int diskWriteVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+    return virtioDiskWriteVector(bufs, startSector, sectorNumber);
+}
+#else
+#include <Sd.h>
+
+static inline int diskInit(void) {
+    return sdInit();
+}
+
+static inline int diskRead(u8 *buf, u64 startSector, u32 sectorNumber) {
+    return sdRead(buf, startSector, sectorNumber);
+}
+
+static inline int diskReadVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+    return sdReadVector(bufs, startSector, sectorNumber);
+}
+
+static inline int diskWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
+    return sdWrite(buf, startSector, sectorNumber);
+}
+
+static inline int diskWriteVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+    return sdWriteVector(bufs, startSector, sectorNumber);
+}
+#endif
+
+#endif
@@ -80,4 +80,10 @@ static inline void sbi_send_ipi(const unsigned long* hart_mask) {
     SBI_CALL_1(SBI_SEND_IPI, hart_mask);
 }
 
+// size (u64)-1 flushes the whole address space
+static inline void sbi_remote_sfence_vma_asid(const unsigned long* hart_mask,
+                                              u64 start, u64 size, u64 asid) {
+    SBI_CALL_4(SBI_REMOTE_SFENCE_VMA_ASID, hart_mask, start, size, asid);
+}
+
 #endif
\ No newline at end of file
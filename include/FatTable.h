@@ -0,0 +1,46 @@
+#ifndef _FAT_TABLE_H_
+#define _FAT_TABLE_H_
+
+#include <Type.h>
+#include <Sleeplock.h>
+#include <MemoryConfig.h>
+
+#define FAT_WINDOW_SECTORS 8  // a window is one page of FAT entries
+#define FAT_WINDOW_NUM 32     // windows kept resident per file system
+#define FAT_WINDOW_NONE 0xffffffff
+#define FAT_ALLOC_RUN 16      // free run wanted before starting a new chain
+#define FAT_MAP_BITS (PAGE_SIZE * 8) // clusters tracked by one bitmap page
+
+typedef struct FileSystem FileSystem;
+
+typedef struct FatWindow {
+    u32 sector;   // first FAT sector held, relative to the start of the FAT
+    u32* entries; // FAT_WINDOW_SECTORS sectors worth of entries
+    u8 dirty;     // bit i set when sector + i differs from the disk
+    u64 lastUse;
+} FatWindow;
+
+typedef struct FatTable {
+    struct Sleeplock lock;
+    FatWindow window[FAT_WINDOW_NUM];
+    int hint;  // window that served the last lookup
+    u64 clock;
+
+    // Free-cluster bitmap (bit set = free), built on first allocation.
+    // freeMap is a page of pointers to the bitmap pages.
+    u64** freeMap;
+    u32 freeCount;
+    u32 nextFree;    // where the next search starts, kept in FSInfo
+    u16 infoSector;  // FSInfo sector number, 0 if there is none
+    bool infoDirty;
+} FatTable;
+
+void fatTableInit(FileSystem* fs, u16 infoSector);
+u32 fatTableRead(FileSystem* fs, u32 cluster);
+void fatTableWrite(FileSystem* fs, u32 cluster, u32 content);
+u32 fatTableAlloc(FileSystem* fs, u32 goal, u32 content);
+u32 fatTableFreeCount(FileSystem* fs);
+void fatTableFlush(FileSystem* fs);
+void fatTableFree(FileSystem* fs);
+
+#endif
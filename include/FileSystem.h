@@ -3,7 +3,9 @@
 #include <Type.h>
 #include <bio.h>
 #include <fat.h>
+#include <FatTable.h>
 #define MAX_NAME_LENGTH 64
+#define FILE_SYSTEM_NUM 32 // size of fileSystem[], mounted images
 
 struct buf;
 typedef struct FileSystem {
@@ -15,11 +17,31 @@ typedef struct FileSystem {
     FileSystem *next;
     int deviceNumber;
     struct buf* (*read)(struct FileSystem *fs, u64 blockNum);
+    // bring count consecutive blocks into the buffer cache
+    void (*prefetch)(struct FileSystem *fs, u64 blockNum, u32 count);
+    FatTable fatTable;
 } FileSystem;
 
+// A name known to be absent from a directory.
+typedef struct NegativeDirent {
+    struct dirent *parent;
+    uint32 hash;
+    char name[FAT32_MAX_FILENAME + 1];
+} NegativeDirent;
+
+typedef struct DirentCacheStat {
+    u64 hits, misses, negativeHits;
+} DirentCacheStat;
+
 typedef struct DirentCache {
     struct Spinlock lock;
     struct dirent entries[ENTRY_CACHE_NUM];
+    struct dirent *hash[ENTRY_HASH_NUM];
+    // unreferenced entries, most recently released at lru.lru_next
+    struct dirent lru;
+    NegativeDirent negative[NEGATIVE_CACHE_NUM];
+    int negativeNext;
+    DirentCacheStat stat;
 } DirentCache;
 
 typedef struct FileSystemStatus {
@@ -31,8 +53,11 @@ typedef struct FileSystemStatus {
 } FileSystemStatus;
 
 int fsAlloc(FileSystem **fs);
+void fsFree(FileSystem *fs);
 int fatInit(FileSystem *fs);
 void initDirentCache();
+void direntCacheStat(DirentCacheStat *stat);
 int getFsStatus(char *path, FileSystemStatus *fss);
+void fsSync(void);
 
 #endif
\ No newline at end of file
@@ -13,7 +13,8 @@
 #define FUTEX_PRIVATE_FLAG 128
 #define FUTEX_COUNT 64
 
-void futexWait(u64 addr, Thread* thread, TimeSpec* ts);
+void futexInit();
+void futexWait(u64 addr, Thread* thread, NanoTimeSpec* ts);
 void futexWake(u64 addr, int n);
 void futexRequeue(u64 addr, int n, u64 newAddr);
 void futexClear(Thread* thread);
@@ -0,0 +1,22 @@
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+#include <Type.h>
+
+// Objects up to KMALLOC_MAX_SIZE come from slabs, pages cut into
+// objects of one power-of-two size class. Larger requests take whole
+// buddy blocks. Each hart caches a few free objects of every class.
+#define KMALLOC_MIN_SHIFT 4   // 16 bytes
+#define KMALLOC_CLASS_NUM 7   // 16 .. 1024 bytes
+#define KMALLOC_MAX_SIZE (1 << (KMALLOC_MIN_SHIFT + KMALLOC_CLASS_NUM - 1))
+#define KMALLOC_CACHE_SIZE 16
+#define KMALLOC_CACHE_BATCH 8 // objects moved between a hart cache and the slabs
+
+// kmalloc flags
+#define KMALLOC_ZERO 1
+
+void kmallocInit(void);
+void *kmalloc(u64 size, int flags);
+void kfree(void *object);
+
+#endif
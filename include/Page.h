@@ -24,10 +24,40 @@ typedef LIST_ENTRY(PhysicalPage) PageListEntry;
 // that have the high bit set.
 #define MAXVA (1L << (9 + 9 + 9 + 12 - 1))
 
+// Free memory is kept in buddy blocks of 2^order pages, the largest
+// of order PAGE_MAX_ORDER - 1. Each hart also keeps a few single pages
+// to itself so that most allocations take no shared lock.
+#define PAGE_MAX_ORDER 11
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_BATCH 32 // pages moved between a hart cache and the buddy lists
+
+// pageAllocFlags: the caller reads the page before writing all of it
+#define PAGE_ALLOC_ZERO 1
+#define PAGE_ZERO_POOL 256 // pages idle harts keep zeroed in advance
+
+// Back user heap and anonymous mmap regions with 2 MiB pages when a
+// whole aligned, untouched 2 MiB range is available. Such a page is
+// split back into 4 KiB pages when only part of it is remapped.
+#define TRANSPARENT_HUGE_PAGE
+#define HUGE_PAGE_ORDER 9
+
+typedef struct HugePageStat {
+    u64 mapped;     // 2 MiB pages handed to user space
+    u64 fallbacks;  // no free 2 MiB block, used 4 KiB pages instead
+    u64 splits;     // 2 MiB pages broken into 4 KiB pages
+} HugePageStat;
+
+#define PAGE_FREE 1   // first page of a free buddy block
+#define PAGE_CACHED 2 // free, held by a hart cache
+#define PAGE_SLAB 4   // cut into kmalloc objects
+#define PAGE_KMALLOC 8 // first page of a kmalloc block of 2^order pages
+
 typedef struct PhysicalPage {
     PageListEntry link;
     u32 ref;
     int hartId;
+    u8 flags;
+    u8 order;  // size of the free block this page starts
 } PhysicalPage;
 
 inline u32 page2PPN(PhysicalPage *page) {
@@ -69,6 +99,9 @@ void startPage();
 #define PTE_ACCESSED (1ll << 6)
 #define PTE_DIRTY (1 << 7)
 #define PTE_COW (1ll << 8)
+#define PTE_IS_LEAF(pte) (((pte) & PTE_VALID) && ((pte) & (PTE_READ | PTE_WRITE | PTE_EXECUTE)))
+#define PAGE_LEVEL_SIZE(level) (1UL << (PAGE_SHIFT + 9 * (level)))
+#define MEGA_PAGE_SIZE PAGE_LEVEL_SIZE(1)
 #define PERM_WIDTH 10
 #define PTE2PERM(pte) (((u64)(pte)) & ~((1ull << 54) - (1ull << 10)))
 #define PTE2PA(pte) (((((u64)(pte)) & ((1ull << 54) - (1ull << 10))) >> PERM_WIDTH) << PAGE_SHIFT)
@@ -85,8 +118,19 @@ inline PhysicalPage* pte2page(u64 *pte) {
 int pageRemove(u64 *pgdir, u64 va);
 int countFreePages();
 int pageAlloc(PhysicalPage **page);
+int pageAllocFlags(PhysicalPage **page, int flags);
+bool pageZeroIdle(void);
+int pageAllocOrder(PhysicalPage **page, int order);
+void pageFreeOrder(PhysicalPage *page, int order);
+void pageFreeInit(u32 startPPN, u32 endPPN);
 int pageInsert(u64 *pgdir, u64 va, u64 pa, u64 perm);
+int pageInsertLevel(u64 *pgdir, u64 va, u64 pa, u64 perm, int level);
+int pageInsertHuge(u64 *pgdir, u64 va, u64 perm);
+int pageSplit(u64 *pgdir, u64 va);
+u64 pageMappingSize(u64 *pgdir, u64 va);
+void hugePageStat(HugePageStat *stat);
 void pgdirFree(u64* pgdir);
+int pgdirFork(u64 *child, u64 *parent);
 u64 pageLookup(u64 *pgdir, u64 va, u64 **pte);
 int allocPgdir(PhysicalPage **page);
 void pageout(u64 *pgdir, u64 badAddr);
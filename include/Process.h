@@ -9,6 +9,7 @@
 #include <file.h>
 #include <Signal.h>
 #include <Resource.h>
+#include <WaitQueue.h>
 
 #define NOFILE 128  //Number of fds that a process can open
 #define LOG_PROCESS_NUM 10
@@ -43,10 +44,14 @@ typedef struct Process {
     LIST_ENTRY(Process) link;
     // u64 awakeTime;
     u64 *pgdir;
+    u64 asid;       // see Asid.h
+    u32 asidHarts;  // harts that have run with this asid
+    u32 asidStale;  // harts that must flush this asid before running it
     u32 processId;
     u32 parentId;
     // LIST_ENTRY(Process) scheduleLink;
-    u32 priority;
+    u32 priority;   // multiplies the scheduling weight, see Yield.h
+    int nice;
     enum ProcessState state;
     struct Spinlock lock;
     // struct dirent *cwd;           // Current directory
@@ -63,6 +68,8 @@ typedef struct Process {
     // u64 clearChildTid;
     int threadCount;
     struct ResourceLimit fileDescription;
+    struct Process *vforkParent; // whose address space this vfork child borrows
+    WaitQueue childExit;         // wait() sleeps here until a child exits
 } Process;
 
 LIST_HEAD(ProcessList, Process);
@@ -104,6 +111,7 @@ void yield();
 SignalAction *getSignalHandler(Process* p);
 void processDestory(Process* p);
 void processFree(Process* p);
+void processDiscard(Process *p);
 int pid2Process(u32 processId, struct Process **process, int checkPerm);
 int either_copyout(int user_dst, u64 dst, void* src, u64 len);
 int either_copyin(void* dst, int user_src, u64 src, u64 len);
@@ -112,4 +120,5 @@ int wait(int, u64);
 int setup(Process *p);
 void kernelProcessCpuTimeBegin(void);
 void kernelProcessCpuTimeEnd(void);
+void vforkRelease(Process *p, u64 heapBottom);
 #endif
\ No newline at end of file
@@ -56,6 +56,7 @@ static inline void w_sstatus(u64 x) {
 }
 
 // Supervisor Interrupt Pending
+#define SIP_SSIP (1L << 1) // software, set by an IPI
 static inline u64 r_sip() {
     u64 x;
     asm volatile("csrr %0, sip" : "=r" (x) );
@@ -150,6 +151,9 @@ static inline void w_mtvec(u64 x) {
 #define SATP_SV39 (8ULL << 60)
 // #define SATP_SV39 0
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((u64)pagetable) >> 12))
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xffffULL
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | (((u64)(asid)) << SATP_ASID_SHIFT))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -273,4 +277,18 @@ static inline void sfence_vma() {
 	asm volatile("sfence.vma");
 }
 
+// flush the entries for one virtual address, in every address space.
+static inline void sfence_vma_va(u64 va) {
+	asm volatile("sfence.vma %0, zero" : : "r" (va) : "memory");
+}
+
+// flush the entries of one address space, only those for va unless it is 0.
+static inline void sfence_vma_asid(u64 va, u64 asid) {
+	if (va) {
+		asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+	} else {
+		asm volatile("sfence.vma zero, %0" : : "r" (asid) : "memory");
+	}
+}
+
 #endif
\ No newline at end of file
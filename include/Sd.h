@@ -5,7 +5,11 @@
 
 int sdInit(void);
 int sdRead(u8 *buf, u64 startSector, u32 sectorNumber);
+int sdReadVector(u8 **bufs, u64 startSector, u32 sectorNumber);
 int sdWrite(u8 *buf, u64 startSector, u32 sectorNumber);
+int sdWriteVector(u8 **bufs, u64 startSector, u32 sectorNumber);
 int sdTest(void);
+int sdCardRead(int isUser, u64 dst, u64 startAddr, u64 n);
+int sdCardWrite(int isUser, u64 src, u64 startAddr, u64 n);
 
 #endif
\ No newline at end of file
@@ -3,11 +3,13 @@
 
 #include "Type.h"
 #include "Spinlock.h"
+#include "WaitQueue.h"
 
 // Long-term locks for processes
 struct Sleeplock {
   uint locked;       // Is the lock held?
   struct Spinlock lk; // spinlock protecting this sleep lock
+  WaitQueue waiters;  // threads waiting for the lock
   
   // For debugging:
   char *name;        // Name of lock.
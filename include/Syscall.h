@@ -15,6 +15,7 @@ void syscallExit();
 void syscallGetCpuTimes();
 void syscallGetTime();
 void syscallSleepTime();
+void syscallClockNanosleep();
 void syscallBrk();
 void syscallSetBrk();
 void syscallMapMemory();
@@ -50,6 +51,16 @@ void syscallGetUserId();
 void syscallGetEffectiveUserId();
 void syscallMemoryBarrier();
 void syscallSignalReturn();
+void syscallSetPriority();
+void syscallGetPriority();
+void syscallKernelStat();
+
+// which counters SYSCALL_KERNEL_STAT copies out
+#define KERNEL_STAT_BUFFER_CACHE 0
+#define KERNEL_STAT_BLOCK_QUEUE 1
+#define KERNEL_STAT_HUGE_PAGE 2
+#define KERNEL_STAT_SCHEDULE 3
+#define KERNEL_STAT_DIRENT_CACHE 4
 
 extern void (*syscallVector[])(void);
 
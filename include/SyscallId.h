@@ -39,6 +39,8 @@
 
 #define SYSCALL_FSTATAT 79
 #define SYSCALL_FSTAT 80
+#define SYSCALL_SYNC 81
+#define SYSCALL_FSYNC 82
 #define SYSCALL_UTIMENSAT 88
 #define SYSCALL_EXIT 93 
 #define SYSCALL_EXIT_GROUP 94 // TODO
@@ -48,6 +50,7 @@
 #define SYSCALL_GET_ROBUST_LIST 100
 #define SYSCALL_SLEEP_TIME 101
 #define SYSCALL_GET_TIME 113
+#define SYSCALL_CLOCK_NANOSLEEP 115
 
 #define SYSCALL_SCHED_YIELD 124
 #define SYSCALL_THREAD_KILL 130
@@ -55,6 +58,8 @@
 #define SYSCALL_SIGNAL_PROCESS_MASK 135
 #define SYSCALL_SIGNAL_TIMED_WAIT 137
 #define SYSCALL_SIGNAL_RETURN 139
+#define SYSCALL_SET_PRIORITY 140
+#define SYSCALL_GET_PRIORITY 141
 #define SYSCALL_GET_CPU_TIMES 153
 #define SYSCALL_UNAME 160
 #define SYSCALL_GET_TIME_OF_DAY 169
@@ -79,6 +84,7 @@
 #define SYSCALL_EXEC 221
 #define SYSCALL_MAP_MEMORY 222
 #define SYSCALL_MEMORY_PROTECT 226
+#define SYSCALL_KERNEL_STAT 245 // not in Linux, see syscallKernelStat()
 #define SYSCALL_WAIT 260
 #define SYSCALL_PROCESS_RESOURSE_LIMIT 261
 
@@ -46,6 +46,8 @@ void syscallWriteVector(void);
 void syscallReadVector(void);
 void syscallPRead();
 void syscallUtimensat();
+void syscallSync(void);
+void syscallFileSync(void);
 
 int getAbsolutePath(struct dirent* d, int isUser, u64 buf, int maxLen);
 
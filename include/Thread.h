@@ -4,6 +4,7 @@
 #include <Signal.h>
 #include <Process.h>
 #include <fat.h>
+#include <WaitQueue.h>
 
 typedef struct Trapframe {
     u64 kernelSatp;
@@ -55,12 +56,19 @@ typedef struct SignalContext {
 typedef struct Thread {
     Trapframe trapframe;
     LIST_ENTRY(Thread) link;
-    u64 awakeTime;
+    u64 awakeTime;          // deadline while in timerSleep(), else 0
+    int timerIndex;         // its place in the timer heap, -1 if none
     u32 id;
     LIST_ENTRY(Thread) scheduleLink;
+    u8 queued;              // on a run queue
+    volatile u8 onHart;     // a hart is running it or still on its stack
+    int hart;               // the hart it last ran on, -1 if none
+    u64 vruntime;           // weighted run time, see Yield.h
+    u64 runStart;           // when it last got a hart
     enum ProcessState state;
     struct Spinlock lock;
     u64 chan;//wait Object
+    LIST_ENTRY(Thread) waitLink;  // on the wait queue it sleeps in
     u64 currentKernelSp;
     int reason;
     u32 retValue;
@@ -71,20 +79,21 @@ typedef struct Thread {
     u64 clearChildTid;
     struct Process* process;
     u64 robustHeadPointer;
+    struct TlbGather *tlbGather;
 	struct SignalContextList waitingSignal;
 } Thread;
 
-LIST_HEAD(ThreadList, Thread);
-
 Thread* myThread(); // Get current running thread in this hart
 void threadFree(Thread *th);
 u64 getThreadTopSp(Thread* th);
 
 void threadInit();
 int mainThreadAlloc(Thread **new, u64 parentId);
+void mainThreadFree(Thread *th);
 int threadAlloc(Thread **new, Process* process, u64 userSp);
 int tid2Thread(u32 threadId, struct Thread **thread, int checkPerm);
 void threadRun(Thread* thread);
+void threadEnqueue(Thread* thread);
 void threadDestroy(Thread* thread);
 
 #define NORMAL         0
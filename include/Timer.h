@@ -4,10 +4,21 @@
 #define INTERVAL 200000
 #include "Type.h"
 
+// r_time() ticks per second, as syscallGetTime counts them
+#define TIMER_FREQUENCY 1000000
+#define NSEC_PER_SEC 1000000000L
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define TIMER_ABSTIME 1
+
 void setNextTimeout(void);
 void timerTick();
+void timerInit();
+void timerPoll();
 
 #define TIMER_INTERRUPT 2
+#define IPI_INTERRUPT 3
 #define SOFTWARE_TRAP 1
 #define UNKNOWN_DEVICE 0
 
@@ -16,6 +27,19 @@ typedef struct TimeSpec {
     long microSecond;    
 } TimeSpec;
 
+// struct timespec as user space passes it to nanosleep and futex
+typedef struct NanoTimeSpec {
+    u64 second;
+    long nanoSecond;
+} NanoTimeSpec;
+
+struct Thread;
+// Sleeping threads wait for their deadline in a min-heap, see Timer.c
+void timerAdd(struct Thread *th, u64 deadline);
+void timerSleep(u64 deadline);
+bool timerCancel(struct Thread *th);
+u64 nanoTimeTicks(NanoTimeSpec *ts);
+
 typedef struct CpuTimes {
     long user;
     long kernel;
@@ -12,6 +12,7 @@ void userVector();
 void userReturn();
 void userTrapReturn();
 void trapframeDump(Trapframe*);
+void devicePoll();
 
 inline static u32 interruptServed() {
     int hart = r_tp();
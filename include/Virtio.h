@@ -0,0 +1,93 @@
+#ifndef _VIRTIO_H_
+#define _VIRTIO_H_
+
+#include <Type.h>
+
+// virtio mmio control registers, mapped starting at VIRTIO0.
+// from qemu virtio_mmio.h
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000 // 0x74726976
+#define VIRTIO_MMIO_VERSION             0x004 // version; should be 2
+#define VIRTIO_MMIO_DEVICE_ID           0x008 // device type; 1 is net, 2 is disk
+#define VIRTIO_MMIO_VENDOR_ID           0x00c // 0x554d4551
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_QUEUE_SEL           0x030 // select queue, write-only
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034 // max size of current queue, read-only
+#define VIRTIO_MMIO_QUEUE_NUM           0x038 // size of current queue, write-only
+#define VIRTIO_MMIO_QUEUE_READY         0x044 // ready bit
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050 // write-only
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060 // read-only
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064 // write-only
+#define VIRTIO_MMIO_STATUS              0x070 // read/write
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080 // physical address for descriptor table, write-only
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_DRIVER_DESC_LOW     0x090 // physical address for available ring, write-only
+#define VIRTIO_MMIO_DRIVER_DESC_HIGH    0x094
+#define VIRTIO_MMIO_DEVICE_DESC_LOW     0x0a0 // physical address for used ring, write-only
+#define VIRTIO_MMIO_DEVICE_DESC_HIGH    0x0a4
+
+// status register bits, from qemu virtio_config.h
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE     1
+#define VIRTIO_CONFIG_S_DRIVER          2
+#define VIRTIO_CONFIG_S_DRIVER_OK       4
+#define VIRTIO_CONFIG_S_FEATURES_OK     8
+
+// device feature bits
+#define VIRTIO_BLK_F_RO                 5  // Disk is read-only
+#define VIRTIO_BLK_F_SCSI               7  // Supports scsi command passthru
+#define VIRTIO_BLK_F_CONFIG_WCE         11 // Writeback mode available in config
+#define VIRTIO_BLK_F_MQ                 12 // support more than one vq
+#define VIRTIO_F_ANY_LAYOUT             27
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+#define VIRTIO_RING_F_EVENT_IDX         29
+
+// Descriptors in the single request queue. A request takes one for its
+// header, one per data buffer and one for the status byte.
+#define VIRTIO_RING_NUM 128
+
+struct VirtqDesc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+#define VRING_DESC_F_NEXT  1 // chained with another descriptor
+#define VRING_DESC_F_WRITE 2 // device writes (vs read)
+
+struct VirtqAvail {
+    u16 flags;
+    u16 idx;                    // driver will write ring[idx] next
+    u16 ring[VIRTIO_RING_NUM];  // descriptor numbers of chain heads
+    u16 unused;
+};
+
+struct VirtqUsedElem {
+    u32 id;   // index of start of completed descriptor chain
+    u32 len;
+};
+
+struct VirtqUsed {
+    u16 flags;
+    u16 idx;  // device increments when it adds a ring[] entry
+    struct VirtqUsedElem ring[VIRTIO_RING_NUM];
+};
+
+// the format of the first descriptor in a disk request.
+// to be followed by descriptors for the data and a one-byte status.
+#define VIRTIO_BLK_T_IN  0 // read the disk
+#define VIRTIO_BLK_T_OUT 1 // write the disk
+
+struct VirtioBlkReq {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+};
+
+int virtioDiskInit(void);
+int virtioDiskRead(u8 *buf, u64 startSector, u32 sectorNumber);
+int virtioDiskReadVector(u8 **bufs, u64 startSector, u32 sectorNumber);
+int virtioDiskWrite(u8 *buf, u64 startSector, u32 sectorNumber);
+int virtioDiskWriteVector(u8 **bufs, u64 startSector, u32 sectorNumber);
+void virtioDiskIntr(void);
+
+#endif
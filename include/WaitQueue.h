@@ -0,0 +1,28 @@
+#ifndef _WAIT_QUEUE_H_
+#define _WAIT_QUEUE_H_
+
+#include <Type.h>
+#include <Queue.h>
+#include <Spinlock.h>
+
+struct Thread;
+LIST_HEAD(ThreadList, Thread);
+
+// Threads sleeping on one object. Waking costs as much as the number of
+// waiters, not of threads. sleep() and wakeup() on a bare channel share
+// a hashed table of these.
+typedef struct WaitQueue {
+    struct Spinlock lock;
+    struct ThreadList waiters;
+} WaitQueue;
+
+#define WAIT_TABLE_SHIFT 6
+#define WAIT_TABLE_SIZE (1 << WAIT_TABLE_SHIFT)
+
+void waitQueueInit(WaitQueue *wq, char *name);
+void waitQueueSleep(WaitQueue *wq, struct Spinlock *lk);
+void waitQueueWakeup(WaitQueue *wq);
+void waitQueueWakeupOne(WaitQueue *wq);
+void waitTableInit();
+
+#endif
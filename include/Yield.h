@@ -1,6 +1,46 @@
 #ifndef _YIELD_H_
 #define _YIELD_H_
 
+#include <Type.h>
+#include <Timer.h>
+
+// Weighted fair scheduling. A thread's vruntime grows by the time it ran
+// scaled by NICE_0_WEIGHT over the weight of its process, and each hart
+// runs its queued thread with the smallest vruntime. The weight comes
+// from the nice value and is multiplied by Process.priority.
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+
+// A thread of weight NICE_0_WEIGHT runs this long before it is preempted,
+// heavier threads longer, in r_time() units. Change it at run time with
+// scheduleSetTimeslice().
+#define SCHEDULE_TIMESLICE (2 * INTERVAL)
+// never preempt a thread after running less than this
+#define SCHEDULE_MIN_GRANULARITY (INTERVAL / 2)
+// a woken thread preempts the running one when it is this much behind
+#define SCHEDULE_WAKEUP_GRANULARITY (INTERVAL / 4)
+
+// per hart counters, only written by their own hart
+typedef struct ScheduleStat {
+    u64 switches;    // threads picked to run
+    u64 steals;      // of those, taken from another hart's queue
+    u64 migrations;  // of those, last run on another hart
+    u64 idle;        // rounds that found nothing to run
+    u64 idleTime;    // r_time() spent waiting in wfi
+    u64 wakeups;     // IPIs sent to idle harts
+} ScheduleStat;
+
+struct Thread;
+struct Process;
+
 void yield();
+void scheduleYield();
+bool schedulePreempt();
+void scheduleInit();
+void scheduleStat(int hartId, ScheduleStat *stat);
+void scheduleSetTimeslice(u64 timeslice);
+u64 threadTimeslice(struct Thread *th);
+u64 processWeight(struct Process *p);
 
-#endif
\ No newline at end of file
+#endif
@@ -7,29 +7,54 @@
 
 #define BSIZE 512
 #define NBUF 4096
+#define BMAXRUN 64 // most blocks moved by one multi-block disk command
+#define NBUCKET 1031 // buffer hash buckets, prime to spread sequential blocks
+
+// bwrite only marks the buffer dirty, blocks reach the disk in sorted
+// batches from bsync/bthrottle. Comment out to write through.
+#define BCACHE_WRITE_BACK
+#define BDIRTY_HIGH (NBUF / 4) // bthrottle flushes above this many dirty
 
 typedef struct FileSystem FileSystem;
 struct dirent;
 struct buf {
     int valid;  // has data been read from disk?
     int disk;   // does disk "own" buf?
+    int dirty;  // modified since it was last written to disk?
     uint dev;
     uint blockno;
     struct Sleeplock lock;
     uint refcnt;
-    struct buf* prev;  // LRU cache list
+    int bucket;        // hash bucket holding this buf, -1 if none
+    struct buf* hnext; // hash chain
+    struct buf* prev;  // LRU list of unreferenced buffers
     struct buf* next;
     uchar data[BSIZE];
 };
 
+typedef struct BufferCacheStat {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 contention; // bucket lock was busy when we tried to take it
+    u64 flushes;    // multi-block writes issued by bflush
+    u64 flushed;    // blocks written back by bflush
+} BufferCacheStat;
+
 void binit(void);
+void bcacheStat(BufferCacheStat* stat);
 
 struct buf* mountBlockRead(FileSystem* fs, u64 blockNum);
 struct buf* blockRead(FileSystem* fs, u64 blockNum);
+void mountBlockPrefetch(FileSystem* fs, u64 blockNum, u32 count);
+void blockPrefetch(FileSystem* fs, u64 blockNum, u32 count);
 
 struct buf* bread(uint dev, uint blockno);
+void breadn(uint dev, uint blockno, uint count);
 void bwrite(struct buf* b);
 void brelse(struct buf* b);
+void bsync(void);
+void bthrottle(void);
 void bpin(struct buf* b);
 void bunpin(struct buf* b);
 
@@ -25,9 +25,25 @@
 
 #define FAT32_MAX_FILENAME 255
 #define FAT32_MAX_PATH 260
-#define ENTRY_CACHE_NUM 50
+#define ENTRY_CACHE_NUM 1024
+#define ENTRY_HASH_NUM 509
+#define NEGATIVE_CACHE_NUM 64
 
 typedef struct FileSystem FileSystem;
+
+// A run of physically contiguous clusters of one file.
+struct extent {
+    uint32 file_clus;  // index of the run's first cluster within the file
+    uint32 disk_clus;  // cluster number of that cluster on the volume
+    uint32 len;        // clusters in the run
+};
+
+// Sectors of a file to read ahead, see eprefetch().
+struct prefetch_run {
+    uint32 sector;
+    uint32 count;
+};
+
 struct superblock {
     uint32 first_data_sec;
     uint32 data_sec_cnt;
@@ -60,6 +76,10 @@ struct dirent {
 
     uint32 cur_clus;
     uint clus_cnt;
+    struct extent* extents;  // cluster map, built on the first seek
+    uint32 extent_cnt;
+    uint32 extent_cap;       // room in extents, grown by doubling
+    uint8 extent_done;       // map reaches the end of the chain
 
     u8 _nt_res;
     FileSystem *fileSystem;
@@ -72,6 +92,12 @@ struct dirent {
     uint32 off;  // offset in the parent dir entry, for writing convenience
     struct dirent* parent;  // because FAT32 doesn't have such thing like inum,
                             // use this for cache trick
+    uint32 name_hash;         // hash of (parent, filename) while hashed
+    uint8 hashed;             // on a direntCache hash chain
+    int children;             // hashed entries whose parent is this one
+    struct dirent* hash_next;
+    struct dirent* lru_next;  // unreferenced entries, see eget()
+    struct dirent* lru_prev;
     // struct dirent* next;
     // struct dirent* prev;
     struct Sleeplock lock;
@@ -100,6 +126,8 @@ struct dirent* edup(struct dirent* entry);
 void eupdate(struct dirent* entry);
 void etrunc(struct dirent* entry);
 void eremove(struct dirent* entry);
+void ehash(struct dirent* entry);
+int epurge(FileSystem* fs);
 void eput(struct dirent* entry);
 void estat(struct dirent* ep, struct stat* st);
 void elock(struct dirent* entry);
@@ -108,6 +136,8 @@ int enext(struct dirent* dp, struct dirent* ep, uint off, int* count);
 struct dirent* ename(int fd, char* path);
 struct dirent* enameparent(int fd, char* path, char* name);
 int eread(struct dirent* entry, int user_dst, u64 dst, uint off, uint n);
+uint eprefetch(struct dirent* entry, uint off, uint n,
+               struct prefetch_run* runs, int max, int* nrun);
 int ewrite(struct dirent* entry, int user_src, u64 src, uint off, uint n);
 struct dirent* create(int fd, char* path, short type, int mode);
 void eSetTime(struct dirent *entry, TimeSpec ts[2]);
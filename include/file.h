@@ -14,7 +14,6 @@
 #define O_DIRECTORY 0x0200000
 
 #define NDEV 4
-#define NFILE 64 //Number of fd that all process can open
 
 typedef struct Socket Socket;
 typedef struct File {
@@ -27,8 +26,14 @@ typedef struct File {
     Socket *socket;
     uint off;     // FD_ENTRY
     short major;  // FD_DEVICE
+    uint raPrev;    // FD_ENTRY: offset the previous read ended at
+    uint raEnd;     // FD_ENTRY: end of the data already read ahead
+    uint raWindow;  // FD_ENTRY: read-ahead size, 0 while access looks random
 } File;
 
+#define READ_AHEAD_MIN (8 * 1024)
+#define READ_AHEAD_MAX (128 * 1024)
+
 #define major(dev) ((dev) >> 16 & 0xFFFF)
 #define minor(dev) ((dev)&0xFFFF)
 #define mkdev(m, n) ((uint)((m) << 16 | (n)))
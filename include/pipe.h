@@ -2,6 +2,7 @@
 #define __PIPE_H
 
 #include <Spinlock.h>
+#include <WaitQueue.h>
 #include <file.h>
 
 #define PIPESIZE 512
@@ -12,6 +13,8 @@ struct pipe {
     uint nwrite;    // number of bytes written
     int readopen;   // read fd is still open
     int writeopen;  // write fd is still open
+    WaitQueue readers;  // waiting for data
+    WaitQueue writers;  // waiting for room
 };
 
 int pipealloc(struct File** f0, struct File** f1);
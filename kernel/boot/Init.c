@@ -3,7 +3,7 @@
 #include <Trap.h>
 #include <Thread.h>
 #include <Riscv.h>
-#include <Sd.h>
+#include <Disk.h>
 #include <fat.h>
 #include <bio.h>
 #include <file.h>
@@ -41,7 +41,7 @@ void main(u64 hartId) {
         processInit();
 
 
-        sdInit();
+        diskInit();
         binit();
         fileinit();
         signalInit();
@@ -37,6 +37,10 @@ static inline void __raw_writel(u32 val, volatile void *addr)
 
 inline void putchar(char ch)
 {
+#ifdef QEMU
+    putcharSBI(ch);
+    return;
+#endif
     int* uartRegTXFIFO = (int*)(uartBaseAddr + UART_REG_TXFIFO);
 	while (readl(uartRegTXFIFO) & UART_TXFIFO_FULL);
     writel(ch, uartRegTXFIFO);
@@ -44,6 +48,11 @@ inline void putchar(char ch)
 
 inline int getchar(void)
 {
+#ifdef QEMU
+    int c;
+    while ((c = getcharSBI()) == -1);
+    return c == '\r' ? '\n' : c;
+#endif
     int* uartRegRXFIFO = (int*)(uartBaseAddr + UART_REG_RXFIFO);
 	u32 ret = readl(uartRegRXFIFO);
     while (ret & UART_RXFIFO_EMPTY) {
@@ -7,6 +7,9 @@
 #include <file.h>
 #include <Process.h>
 #include <Page.h>
+#include <Disk.h>
+#include <bio.h>
+#include <string.h>
 
 //#include "common.h"
 
@@ -168,7 +171,9 @@ static u16 crc16_round(u16 crc, u8 data) {
 //static const char spinner[] = { '-', '/', '|', '\\' };
 
 
-int sdRead(u8 *buf, u64 startSector, u32 sectorNumber) {
+// Read sectorNumber sectors with one CMD18. Sector i lands in bufs[i]
+// when a vector is given, otherwise at buf + i * 512.
+static int sdReadSectors(u8 *buf, u8 **bufs, u64 startSector, u32 sectorNumber) {
 	// printf("[SD Read]Read: %x\n", startSector);
 	int readTimes = 0;
 	int tot = 0;
@@ -194,6 +199,9 @@ start:
 
 		crc = 0;
 		n = 512;
+		if (bufs) {
+			p = bufs[sectorNumber - tot];
+		}
 		timeout = MAX_TIMES;
 		while (--timeout) {
 			x = sd_dummy();
@@ -250,6 +258,15 @@ retry:
 	goto start;
 }
 
+int sdRead(u8 *buf, u64 startSector, u32 sectorNumber) {
+	return sdReadSectors(buf, 0, startSector, sectorNumber);
+}
+
+// Multi-block read scattered into sectorNumber separate 512-byte buffers.
+int sdReadVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+	return sdReadSectors(0, bufs, startSector, sectorNumber);
+}
+
 /* int sdWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
 	printf("[SD Write]Write: %x %d\n", startSector, sectorNumber);
 	int writeTimes = 0, tot = 0;
@@ -392,7 +409,10 @@ retry:
 // }
 
 // This is CMD24
-int sdWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
+// Sector i is taken from bufs[i] when a vector is given, otherwise from
+// buf + i * 512. CMD25 is not reliable on our card (see above), so a
+// batch still costs one command per sector.
+static int sdWriteSectors(u8 *buf, u8 **bufs, u64 startSector, u32 sectorNumber) {
 	// printf("[SD Write]Write: %x %d\n", startSector, sectorNumber);
 	u8 *p = buf;
 	u8 x;
@@ -400,7 +420,7 @@ int sdWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
 
 	for (int i = 0; i < sectorNumber; i++) {
 		u64 now = startSector + i;
-		u8* st = p;
+		u8* st = bufs ? bufs[i] : p;
 		writeTimes = 0;
 start:	p = st;
 		#ifdef QEMU
@@ -458,6 +478,17 @@ retry:
 	goto start;
 }
 
+int sdWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
+	return sdWriteSectors(buf, 0, startSector, sectorNumber);
+}
+
+int sdWriteVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+	return sdWriteSectors(0, bufs, startSector, sectorNumber);
+}
+
+// Raw access to the card goes through the buffer cache, so it sees
+// blocks that are still dirty there and shares the block queue with
+// the file system instead of racing it on the device.
 int sdCardRead(int isUser, u64 dst, u64 startAddr, u64 n) {
 	if (n & ((1 << 9) - 1)) {
 		printf("[SD] Card Read error\n");
@@ -468,21 +499,15 @@ int sdCardRead(int isUser, u64 dst, u64 startAddr, u64 n) {
 		return -1;	
 	}
 
-	if (isUser) {
-		char buf[512];
-		int st = (startAddr) >> 9;
-		for (int i = 0; i < n; i++) {
-			sdRead((u8*)buf, st, 1);
-			copyout(myProcess()->pgdir, dst, buf, 512);
-			dst += 512;
-			st++;
-		}
-		return 0;
-	}
 	int st = (startAddr) >> 9;
-	for (int i = 0; i < n; i++) {
-		sdRead((u8*)dst, st, 1);
-		dst += 512;
+	for (u64 i = 0; i < (n >> 9); i++) {
+		struct buf* b = bread(DEV_SD, st);
+		int r = either_copyout(isUser, dst, b->data, BSIZE);
+		brelse(b);
+		if (r < 0) {
+			return -1;
+		}
+		dst += BSIZE;
 		st++;
 	}
 	return 0;
@@ -498,21 +523,17 @@ int sdCardWrite(int isUser, u64 src, u64 startAddr, u64 n) {
 		return -1;	
 	}
 
-	if (isUser) {
-		char buf[512];
-		int st = (startAddr) >> 9;
-		for (int i = 0; i < n; i++) {
-        	copyin(myProcess()->pgdir, buf, src, 512);
-			sdWrite((u8*)buf, st, 1);
-			src += 512;
-			st++;
-		}
-		return 0;
-	}
+	char data[BSIZE];
 	int st = (startAddr) >> 9;
-	for (int i = 0; i < n; i++) {
-		sdWrite((u8*)src, st, 1);
-		src += 512;
+	for (u64 i = 0; i < (n >> 9); i++) {
+		if (either_copyin(data, isUser, src, BSIZE) < 0) {
+			return -1;
+		}
+		struct buf* b = bread(DEV_SD, st);
+		memmove(b->data, data, BSIZE);
+		bwrite(b);
+		brelse(b);
+		src += BSIZE;
 		st++;
 	}
 	return 0;
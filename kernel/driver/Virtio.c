@@ -0,0 +1,297 @@
+// Driver for qemu's virtio disk device.
+// Uses qemu's mmio interface to virtio.
+//
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0
+//     -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+//     -global virtio-mmio.force-legacy=false
+//
+// Requests are chained into the descriptor table and completed from the
+// PLIC interrupt, so the hart is free while the device works.
+
+#include <Type.h>
+#include <Driver.h>
+#include <MemoryConfig.h>
+#include <Spinlock.h>
+#include <Virtio.h>
+#include <Page.h>
+#include <Thread.h>
+#include <Process.h>
+#include <Sd.h>
+#include <file.h>
+#include <string.h>
+
+#define R(r) ((volatile u32 *)(VIRTIO0_V + (r)))
+
+static struct Disk {
+    struct Spinlock lock;
+
+    // the three rings, each in a page of its own
+    struct VirtqDesc *desc;
+    struct VirtqAvail *avail;
+    struct VirtqUsed *used;
+
+    u8 free[VIRTIO_RING_NUM];  // is a descriptor free?
+    int freeCount;
+    u16 usedIdx;               // we've looked this far in used->ring
+
+    // per request state, indexed by the first descriptor of the chain
+    struct {
+        u8 status;
+        u8 done;
+    } info[VIRTIO_RING_NUM];
+    struct VirtioBlkReq ops[VIRTIO_RING_NUM];
+} disk;
+
+static void *ringAlloc() {
+    PhysicalPage *page;
+    if (pageAlloc(&page) < 0) {
+        panic("virtio disk: no memory for rings");
+    }
+    return (void *)page2pa(page);
+}
+
+int virtioDiskInit(void) {
+    u32 status = 0;
+
+    initLock(&disk.lock, "virtio_disk");
+
+    if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+        *R(VIRTIO_MMIO_VERSION) != 2 ||
+        *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
+        *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551) {
+        panic("could not find virtio disk");
+    }
+
+    // reset device
+    *R(VIRTIO_MMIO_STATUS) = status;
+
+    status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
+    *R(VIRTIO_MMIO_STATUS) = status;
+    status |= VIRTIO_CONFIG_S_DRIVER;
+    *R(VIRTIO_MMIO_STATUS) = status;
+
+    // negotiate features
+    u64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+    features &= ~(1 << VIRTIO_BLK_F_RO);
+    features &= ~(1 << VIRTIO_BLK_F_SCSI);
+    features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
+    features &= ~(1 << VIRTIO_BLK_F_MQ);
+    features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
+    features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
+    features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+    *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    *R(VIRTIO_MMIO_STATUS) = status;
+    if (!(*R(VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        panic("virtio disk FEATURES_OK unset");
+    }
+
+    // initialize queue 0.
+    *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+    if (*R(VIRTIO_MMIO_QUEUE_READY)) {
+        panic("virtio disk should not be ready");
+    }
+    u32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (max == 0) {
+        panic("virtio disk has no queue 0");
+    }
+    if (max < VIRTIO_RING_NUM) {
+        panic("virtio disk max queue too short");
+    }
+
+    disk.desc = ringAlloc();
+    disk.avail = ringAlloc();
+    disk.used = ringAlloc();
+
+    *R(VIRTIO_MMIO_QUEUE_NUM) = VIRTIO_RING_NUM;
+    *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (u64)disk.desc;
+    *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (u64)disk.desc >> 32;
+    *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (u64)disk.avail;
+    *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (u64)disk.avail >> 32;
+    *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (u64)disk.used;
+    *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (u64)disk.used >> 32;
+    *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+    for (int i = 0; i < VIRTIO_RING_NUM; i++) {
+        disk.free[i] = 1;
+    }
+    disk.freeCount = VIRTIO_RING_NUM;
+
+    status |= VIRTIO_CONFIG_S_DRIVER_OK;
+    *R(VIRTIO_MMIO_STATUS) = status;
+
+    devsw[DEV_SD].read = sdCardRead;
+    devsw[DEV_SD].write = sdCardWrite;
+    printf("[virtio disk]init finish!\n");
+    return 0;
+}
+
+// Wait on chan with disk.lock held. Nothing can sleep before the first
+// thread runs, so early callers poll the used ring instead.
+static void virtioWait(void *chan) {
+    if (myThread() != NULL) {
+        sleep(chan, &disk.lock);
+        return;
+    }
+    releaseLock(&disk.lock);
+    virtioDiskIntr();
+    acquireLock(&disk.lock);
+}
+
+// Take n descriptors, waiting until that many are free.
+static void allocDesc(int *idx, int n) {
+    while (disk.freeCount < n) {
+        virtioWait(&disk.free[0]);
+    }
+    for (int i = 0, j = 0; j < n; i++) {
+        if (disk.free[i]) {
+            disk.free[i] = 0;
+            idx[j++] = i;
+        }
+    }
+    disk.freeCount -= n;
+}
+
+static void freeChain(int i) {
+    while (1) {
+        int flag = disk.desc[i].flags;
+        int next = disk.desc[i].next;
+        disk.desc[i].addr = 0;
+        disk.desc[i].len = 0;
+        disk.desc[i].flags = 0;
+        disk.desc[i].next = 0;
+        disk.free[i] = 1;
+        disk.freeCount++;
+        if (!(flag & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = next;
+    }
+    wakeup(&disk.free[0]);
+}
+
+// The device sees physical addresses. Kernel data and the buffer cache
+// are mapped one to one, but a kernel stack is not.
+static inline bool directMapped(u8 *buf) {
+    return (u64)buf >= PHYSICAL_ADDRESS_BASE && (u64)buf < PHYSICAL_MEMORY_TOP;
+}
+
+// Transfer sectorNumber sectors starting at startSector, either to or
+// from the contiguous buf, or one sector per bufs[i].
+static int virtioDiskRW(u8 *buf, u8 **bufs, u64 startSector, u32 sectorNumber, bool write) {
+    int idx[VIRTIO_RING_NUM];
+    int n = (bufs ? sectorNumber : 1) + 2;
+    u8 *user = NULL;
+    PhysicalPage *bounce = NULL;
+
+    if (n > VIRTIO_RING_NUM) {
+        panic("virtio disk: request too long");
+    }
+    if (buf && !directMapped(buf)) {
+        if (sectorNumber * 512 > PAGE_SIZE || pageAllocFlags(&bounce, 0) < 0) {
+            panic("virtio disk: can not bounce the buffer");
+        }
+        user = buf;
+        buf = (u8 *)page2pa(bounce);
+        if (write) {
+            memmove(buf, user, sectorNumber * 512);
+        }
+    }
+
+    acquireLock(&disk.lock);
+    allocDesc(idx, n);
+
+    int head = idx[0];
+    struct VirtioBlkReq *op = &disk.ops[head];
+    op->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    op->reserved = 0;
+    op->sector = startSector;
+
+    disk.desc[head].addr = (u64)op;
+    disk.desc[head].len = sizeof(struct VirtioBlkReq);
+    disk.desc[head].flags = VRING_DESC_F_NEXT;
+    disk.desc[head].next = idx[1];
+
+    for (int i = 1; i < n - 1; i++) {
+        struct VirtqDesc *d = &disk.desc[idx[i]];
+        d->addr = bufs ? (u64)bufs[i - 1] : (u64)buf;
+        d->len = bufs ? 512 : sectorNumber * 512;
+        // device reads the data for a write, and writes it for a read
+        d->flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+        d->next = idx[i + 1];
+    }
+
+    disk.info[head].status = 0xff;  // device writes 0 on success
+    disk.info[head].done = 0;
+    disk.desc[idx[n - 1]].addr = (u64)&disk.info[head].status;
+    disk.desc[idx[n - 1]].len = 1;
+    disk.desc[idx[n - 1]].flags = VRING_DESC_F_WRITE;
+    disk.desc[idx[n - 1]].next = 0;
+
+    // tell the device the first index in our chain of descriptors.
+    disk.avail->ring[disk.avail->idx % VIRTIO_RING_NUM] = head;
+    __sync_synchronize();
+    disk.avail->idx += 1;
+    __sync_synchronize();
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;  // value is queue number
+
+    // wait for virtioDiskIntr() to say the request has finished.
+    while (!disk.info[head].done) {
+        virtioWait(&disk.info[head]);
+    }
+
+    int r = disk.info[head].status == 0 ? 0 : -1;
+    freeChain(head);
+    releaseLock(&disk.lock);
+
+    if (bounce) {
+        if (!write) {
+            memmove(user, buf, sectorNumber * 512);
+        }
+        pageFree(bounce);
+    }
+    return r;
+}
+
+int virtioDiskRead(u8 *buf, u64 startSector, u32 sectorNumber) {
+    return virtioDiskRW(buf, NULL, startSector, sectorNumber, false);
+}
+
+int virtioDiskReadVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+    return virtioDiskRW(NULL, bufs, startSector, sectorNumber, false);
+}
+
+int virtioDiskWrite(u8 *buf, u64 startSector, u32 sectorNumber) {
+    return virtioDiskRW(buf, NULL, startSector, sectorNumber, true);
+}
+
+int virtioDiskWriteVector(u8 **bufs, u64 startSector, u32 sectorNumber) {
+    return virtioDiskRW(NULL, bufs, startSector, sectorNumber, true);
+}
+
+void virtioDiskIntr(void) {
+    acquireLock(&disk.lock);
+
+    // the device won't raise another interrupt until we tell it
+    // we've seen this interrupt, which the following line does.
+    // this may race with the device writing new entries to
+    // the "used" ring, in which case we may process the new
+    // completion entries in this interrupt, and have nothing to do
+    // in the next interrupt, which is harmless.
+    *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+    __sync_synchronize();
+
+    // the device increments disk.used->idx when it
+    // adds an entry to the used ring.
+    while (disk.usedIdx != disk.used->idx) {
+        __sync_synchronize();
+        int id = disk.used->ring[disk.usedIdx % VIRTIO_RING_NUM].id;
+        disk.info[id].done = 1;
+        wakeup(&disk.info[id]);
+        disk.usedIdx += 1;
+    }
+
+    releaseLock(&disk.lock);
+}
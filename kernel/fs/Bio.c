@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -21,30 +21,64 @@
 // #include "Defs.h"
 // #include "fs.h"
 #include "Driver.h"
-#include "Sd.h"
+#include "BlockQueue.h"
 #include "bio.h"
 #include <FileSystem.h>
 #include <file.h>
 
+struct bucket {
+    struct Spinlock lock;
+    struct buf* head;
+};
+
 struct {
+    // Protects the LRU list below. Only buffers with refcnt == 0 are on it.
     struct Spinlock lock;
+    // Serializes recycling, so a missing block can only be inserted
+    // into its bucket by the hart holding this lock.
+    struct Spinlock evictLock;
     struct buf buf[NBUF];
 
-    // Linked list of all buffers, through prev/next.
+    // Linked list of unreferenced buffers, through prev/next.
     // Sorted by how recently the buffer was used.
     // head.next is most recent, head.prev is least.
     struct buf head;
+
+    // Unreferenced dirty buffers wait here instead, so they are only
+    // picked for recycling, and written back first, when no clean
+    // buffer is left.
+    struct buf dirty;
+    int ndirty;
+
+    // Buffers hashed by (dev, blockno). A bucket lock protects the chain
+    // and the refcnt of every buffer on it.
+    struct bucket bucket[NBUCKET];
+
+    BufferCacheStat stat;
 } bcache;
 
+#define BHASH(dev, blockno) ((((dev) << 16) ^ (blockno)) % NBUCKET)
+
 void binit(void) {
     struct buf* b;
 
+    blockQueueInit();
     initLock(&bcache.lock, "bcache");
+    initLock(&bcache.evictLock, "bcache.evict");
+    for (int i = 0; i < NBUCKET; i++) {
+        initLock(&bcache.bucket[i].lock, "bcache.bucket");
+        bcache.bucket[i].head = 0;
+    }
 
     // Create linked list of buffers
     bcache.head.prev = &bcache.head;
     bcache.head.next = &bcache.head;
+    bcache.dirty.prev = &bcache.dirty;
+    bcache.dirty.next = &bcache.dirty;
     for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+        b->bucket = -1;
+        b->hnext = 0;
+        b->dirty = 0;
         b->next = bcache.head.next;
         b->prev = &bcache.head;
         initsleeplock(&b->lock, "buffer");
@@ -53,40 +87,185 @@ void binit(void) {
     }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf* bget(int dev, uint blockno) {
+void bcacheStat(BufferCacheStat* stat) {
+    *stat = bcache.stat;
+}
+
+static void bucketLock(struct bucket* bk) {
+    if (bk->lock.locked) {
+        __sync_fetch_and_add(&bcache.stat.contention, 1);
+    }
+    acquireLock(&bk->lock);
+}
+
+// Caller holds bcache.lock.
+static void lruRemove(struct buf* b) {
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+}
+
+// Caller holds bcache.lock.
+static void lruInsertHead(struct buf* b) {
+    struct buf* head = b->dirty ? &bcache.dirty : &bcache.head;
+    b->next = head->next;
+    b->prev = head;
+    head->next->prev = b;
+    head->next = b;
+}
+
+// Take a reference on an unlocked buffer, pulling it off the LRU (or
+// dirty) list if it was unreferenced. Caller holds the buffer's bucket lock.
+static void bref(struct buf* b) {
+    if (b->refcnt++ == 0) {
+        acquireLock(&bcache.lock);
+        lruRemove(b);
+        releaseLock(&bcache.lock);
+    }
+}
+
+// Drop a reference, putting the buffer on the most-recently-used end
+// of the LRU list once nobody holds it. Caller holds the bucket lock.
+static void bderef(struct buf* b) {
+    if (--b->refcnt == 0) {
+        acquireLock(&bcache.lock);
+        lruInsertHead(b);
+        releaseLock(&bcache.lock);
+    }
+}
+
+// Look the block up in its bucket and take a reference on it.
+static struct buf* bfind(struct bucket* bk, uint dev, uint blockno) {
     struct buf* b;
+    bucketLock(bk);
+    for (b = bk->head; b; b = b->hnext) {
+        if (b->dev == dev && b->blockno == blockno) {
+            bref(b);
+            break;
+        }
+    }
+    releaseLock(&bk->lock);
+    return b;
+}
 
-    acquireLock(&bcache.lock);
+// Unhash the least recently used clean unreferenced buffer and hand it
+// to the caller with refcnt 0. If every unreferenced buffer is dirty,
+// nothing is unhashed: the oldest dirty one is returned in *dirty with
+// a reference held, for the caller to write back while it stays
+// findable. Caller holds bcache.evictLock.
+static struct buf* brecycle(struct buf** dirty) {
+    struct buf *b, **pp;
+    struct bucket* bk;
 
-    if (dev >= 0) {
-        for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-            if (b->dev == dev && b->blockno == blockno) {
-                b->refcnt++;
-                releaseLock(&bcache.lock);
-                acquiresleep(&b->lock);
-                return b;
+    for (;;) {
+        acquireLock(&bcache.lock);
+        b = bcache.head.prev;
+        if (b == &bcache.head) {
+            b = bcache.dirty.prev;
+            if (b == &bcache.dirty) {
+                panic("bget: no buffers");
             }
         }
-    }
-    // Is the block already cached?    
+        if (b->bucket < 0) {
+            // Never hashed, nobody else can find it.
+            lruRemove(b);
+            releaseLock(&bcache.lock);
+            return b;
+        }
+        releaseLock(&bcache.lock);
 
-    // Not cached.
-    // Recycle the least recently used (LRU) unused buffer.
-    for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+        // The bucket lock comes before bcache.lock, so look again
+        // once we hold it: a hit may have grabbed the buffer meanwhile.
+        bk = &bcache.bucket[b->bucket];
+        bucketLock(bk);
+        if (b->refcnt == 0 && b->dirty) {
+            bref(b);
+            releaseLock(&bk->lock);
+            *dirty = b;
+            return NULL;
+        }
         if (b->refcnt == 0) {
-            b->dev = dev;
-            b->blockno = blockno;
-            b->valid = 0;
-            b->refcnt = 1;
+            acquireLock(&bcache.lock);
+            lruRemove(b);
             releaseLock(&bcache.lock);
+            for (pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+                ;
+            *pp = b->hnext;
+            b->hnext = 0;
+            b->bucket = -1;
+            releaseLock(&bk->lock);
+            __sync_fetch_and_add(&bcache.stat.evictions, 1);
+            return b;
+        }
+        releaseLock(&bk->lock);
+    }
+}
+
+// Write back a dirty buffer brecycle() holds a reference on. It stays
+// hashed, so a bget() of its block waits on its lock instead of
+// reading stale data from disk. brelse() then leaves it on the clean
+// LRU list for the next brecycle().
+static void bclean(struct buf* b) {
+    acquiresleep(&b->lock);
+    if (b->dirty) {
+        u8* data = b->data;
+        blockSubmit(true, &data, b->blockno, 1);
+        b->dirty = 0;
+        __sync_fetch_and_sub(&bcache.ndirty, 1);
+        __sync_fetch_and_add(&bcache.stat.flushes, 1);
+        __sync_fetch_and_add(&bcache.stat.flushed, 1);
+    }
+    brelse(b);
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf* bget(uint dev, uint blockno) {
+    int h = BHASH(dev, blockno);
+    struct bucket* bk = &bcache.bucket[h];
+    struct buf *b, *dirty;
+
+    for (;;) {
+        // Is the block already cached?
+        if ((b = bfind(bk, dev, blockno)) != 0) {
+            __sync_fetch_and_add(&bcache.stat.hits, 1);
+            acquiresleep(&b->lock);
+            return b;
+        }
+
+        // Not cached. Check again under evictLock, another hart may have
+        // brought the block in since we looked.
+        acquireLock(&bcache.evictLock);
+        if ((b = bfind(bk, dev, blockno)) != 0) {
+            releaseLock(&bcache.evictLock);
+            __sync_fetch_and_add(&bcache.stat.hits, 1);
             acquiresleep(&b->lock);
             return b;
         }
+
+        // Recycle the least recently used (LRU) unused buffer.
+        if ((b = brecycle(&dirty)) != 0) {
+            break;
+        }
+        // No clean buffer was left. Write one back without holding
+        // evictLock and look again.
+        releaseLock(&bcache.evictLock);
+        bclean(dirty);
     }
-    panic("bget: no buffers");
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->refcnt = 1;
+    bucketLock(bk);
+    b->bucket = h;
+    b->hnext = bk->head;
+    bk->head = b;
+    releaseLock(&bk->lock);
+    releaseLock(&bcache.evictLock);
+
+    __sync_fetch_and_add(&bcache.stat.misses, 1);
+    acquiresleep(&b->lock);
+    return b;
 }
 
 struct buf* mountBlockRead(FileSystem* fs, u64 blockNum) {
@@ -108,6 +287,42 @@ struct buf* blockRead(FileSystem* fs, u64 blockNum) {
     return bread(fs->deviceNumber, blockNum);
 }
 
+// Translate the blocks through the image file and prefetch each run
+// that is contiguous in the parent file system.
+void mountBlockPrefetch(FileSystem* fs, u64 blockNum, u32 count) {
+    struct File* file = fs->image;
+    if (file->type == FD_DEVICE) {
+        breadn(file->major, blockNum, count);
+        return;
+    }
+    assert(file->type == FD_ENTRY);
+    struct dirent *image = fs->image->ep;
+    FileSystem* parentFs = image->fileSystem;
+    int start = -1, len = 0;
+    for (u32 i = 0; i < count; i++) {
+        int parentBlockNum = getBlockNumber(image, blockNum + i);
+        if (parentBlockNum < 0) {
+            break;
+        }
+        if (len > 0 && parentBlockNum == start + len) {
+            len++;
+            continue;
+        }
+        if (len > 0) {
+            parentFs->prefetch(parentFs, start, len);
+        }
+        start = parentBlockNum;
+        len = 1;
+    }
+    if (len > 0) {
+        parentFs->prefetch(parentFs, start, len);
+    }
+}
+
+void blockPrefetch(FileSystem* fs, u64 blockNum, u32 count) {
+    breadn(fs->deviceNumber, blockNum, count);
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf* bread(uint dev, uint blockno) {
     // static int cnt = 0;
@@ -115,17 +330,154 @@ struct buf* bread(uint dev, uint blockno) {
     struct buf* b;
     b = bget(dev, blockno);
     if (!b->valid) {
-        sdRead(b->data, b->blockno, 1);
+        u8* data = b->data;
+        blockSubmit(false, &data, b->blockno, 1);
         b->valid = 1;
     }
     return b;
 }
 
+// Make sure blocks [blockno, blockno + count) are cached. Each run of
+// missing blocks is fetched with a single multi-block read instead of
+// one command per block. The caller must not hold any buffer, since
+// up to BMAXRUN buffers are locked here at once.
+void breadn(uint dev, uint blockno, uint count) {
+    struct buf* b[BMAXRUN];
+    u8* data[BMAXRUN];
+    uint n, i, j;
+
+    while (count > 0) {
+        n = MIN(count, (uint)BMAXRUN);
+        for (i = 0; i < n; i++) {
+            b[i] = bget(dev, blockno + i);
+        }
+        for (i = 0; i < n; i = j) {
+            for (j = i; j < n && !b[j]->valid; j++) {
+                data[j - i] = b[j]->data;
+            }
+            if (j == i) {
+                j++;
+                continue;
+            }
+            blockSubmit(false, data, blockno + i, j - i);
+            while (i < j) {
+                b[i++]->valid = 1;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            brelse(b[i]);
+        }
+        blockno += n;
+        count -= n;
+    }
+}
+
 // Write b's contents to disk.  Must be locked.
+// In write-back mode the block is only marked dirty here.
 void bwrite(struct buf* b) {
     if (!holdingsleep(&b->lock))
         panic("bwrite");
-    sdWrite(b->data, b->blockno, 1);
+#ifdef BCACHE_WRITE_BACK
+    if (!b->dirty) {
+        b->dirty = 1;
+        __sync_fetch_and_add(&bcache.ndirty, 1);
+    }
+#else
+    u8* data = b->data;
+    blockSubmit(true, &data, b->blockno, 1);
+#endif
+}
+
+// Write the locked buffers b[0..n), sorted by block, back to disk,
+// coalescing consecutive blocks into one multi-block write.
+static void bwriteback(struct buf** b, int n) {
+    u8* data[BMAXRUN];
+    int i, j;
+
+    for (i = 0; i < n; i = j) {
+        data[0] = b[i]->data;
+        for (j = i + 1; j < n && j - i < BMAXRUN && b[j]->dev == b[i]->dev &&
+                        b[j]->blockno == b[i]->blockno + (j - i); j++) {
+            data[j - i] = b[j]->data;
+        }
+        blockSubmit(true, data, b[i]->blockno, j - i);
+        __sync_fetch_and_add(&bcache.stat.flushes, 1);
+        __sync_fetch_and_add(&bcache.stat.flushed, j - i);
+    }
+}
+
+// Write dirty buffers back in batches sorted by block number.
+// Buffers somebody holds are skipped unless all is set, in which case
+// we wait for them and the caller must not hold any buffer itself.
+static void bflush(int all) {
+    struct buf* batch[BMAXRUN * 2];
+    struct buf *b, *t;
+    struct bucket* bk;
+    int i, j, n;
+
+    b = bcache.buf;
+    while (b < bcache.buf + NBUF) {
+        // Pin a batch of dirty buffers.
+        n = 0;
+        for (; b < bcache.buf + NBUF && n < NELEM(batch); b++) {
+            // b->bucket is read without evictLock, so it may be stale.
+            // It only changes under the lock of the bucket it names, so
+            // once we hold that lock and it still matches it is stable.
+            int h = b->bucket;
+            if (!b->dirty || h < 0) {
+                continue;
+            }
+            bk = &bcache.bucket[h];
+            bucketLock(bk);
+            if (b->bucket == h && b->dirty && (all || b->refcnt == 0)) {
+                bref(b);
+                batch[n++] = b;
+            }
+            releaseLock(&bk->lock);
+        }
+
+        // Sort by (dev, blockno) and lock in that order like breadn.
+        for (i = 1; i < n; i++) {
+            t = batch[i];
+            for (j = i; j > 0 && (batch[j - 1]->dev > t->dev ||
+                                  (batch[j - 1]->dev == t->dev &&
+                                   batch[j - 1]->blockno > t->blockno));
+                 j--) {
+                batch[j] = batch[j - 1];
+            }
+            batch[j] = t;
+        }
+        for (i = 0, j = 0; i < n; i++) {
+            acquiresleep(&batch[i]->lock);
+            if (batch[i]->dirty) {
+                batch[j++] = batch[i];
+            } else {
+                brelse(batch[i]); // someone else wrote it back meanwhile
+            }
+        }
+
+        bwriteback(batch, j);
+
+        for (i = 0; i < j; i++) {
+            batch[i]->dirty = 0;
+            __sync_fetch_and_sub(&bcache.ndirty, 1);
+            brelse(batch[i]);
+        }
+    }
+}
+
+// Write every dirty buffer back to disk. The caller must not hold any
+// buffer.
+void bsync(void) {
+    bflush(1);
+}
+
+// Keep the number of dirty buffers bounded so recycling rarely has to
+// write one back itself. Call it between buffer operations, holding no buffer.
+void bthrottle(void) {
+    if (bcache.ndirty > BDIRTY_HIGH) {
+        bflush(0);
+    }
 }
 
 // Release a locked buffer.
@@ -136,29 +488,22 @@ void brelse(struct buf* b) {
 
     releasesleep(&b->lock);
 
-    acquireLock(&bcache.lock);
-    b->refcnt--;
-    if (b->refcnt == 0) {
-        // no one is waiting for it.
-        b->next->prev = b->prev;
-        b->prev->next = b->next;
-        b->next = bcache.head.next;
-        b->prev = &bcache.head;
-        bcache.head.next->prev = b;
-        bcache.head.next = b;
-    }
-
-    releaseLock(&bcache.lock);
+    struct bucket* bk = &bcache.bucket[b->bucket];
+    bucketLock(bk);
+    bderef(b);
+    releaseLock(&bk->lock);
 }
 
 void bpin(struct buf* b) {
-    acquireLock(&bcache.lock);
-    b->refcnt++;
-    releaseLock(&bcache.lock);
+    struct bucket* bk = &bcache.bucket[b->bucket];
+    bucketLock(bk);
+    bref(b);
+    releaseLock(&bk->lock);
 }
 
 void bunpin(struct buf* b) {
-    acquireLock(&bcache.lock);
-    b->refcnt--;
-    releaseLock(&bcache.lock);
+    struct bucket* bk = &bcache.bucket[b->bucket];
+    bucketLock(bk);
+    bderef(b);
+    releaseLock(&bk->lock);
 }
@@ -0,0 +1,195 @@
+// Block request queue.
+//
+// Bio.c hands every transfer to blockSubmit() instead of calling the
+// driver. Queued requests are kept sorted by sector. Whoever finds the
+// queue idle becomes the dispatcher and serves it in one direction
+// (C-LOOK), folding requests that continue each other into a single
+// multi-block command. A request that waited past its deadline is served
+// first. No request passes an older one on the same sectors when either
+// of them writes. Everyone else sleeps until their request completes.
+
+#include <Type.h>
+#include <Riscv.h>
+#include <Driver.h>
+#include <Spinlock.h>
+#include <Thread.h>
+#include <Process.h>
+#include <Disk.h>
+#include <bio.h>
+#include <BlockQueue.h>
+
+static struct {
+    struct Spinlock lock;
+    BlockRequestList queue;
+    int depth;
+    bool dispatching;  // somebody is serving the queue
+    u64 position;      // sector following the last dispatched run
+    u64 nextSeq;
+    BlockQueueStat stat;
+} blockQueue;
+
+void blockQueueInit(void) {
+    initLock(&blockQueue.lock, "blockQueue");
+    LIST_INIT(&blockQueue.queue);
+}
+
+void blockQueueStat(BlockQueueStat *stat) {
+    acquireLock(&blockQueue.lock);
+    *stat = blockQueue.stat;
+    releaseLock(&blockQueue.lock);
+}
+
+static void enqueue(BlockRequest *req) {
+    BlockRequest *r, *last = NULL;
+    req->seq = blockQueue.nextSeq++;
+    LIST_FOREACH(r, &blockQueue.queue, link) {
+        if (r->sector > req->sector) {
+            LIST_INSERT_BEFORE(r, req, link);
+            break;
+        }
+        last = r;
+    }
+    if (r == NULL) {
+        if (last) {
+            LIST_INSERT_AFTER(last, req, link);
+        } else {
+            LIST_INSERT_HEAD(&blockQueue.queue, req, link);
+        }
+    }
+    blockQueue.depth++;
+    blockQueue.stat.requests++;
+    blockQueue.stat.depthSum += blockQueue.depth;
+    if (blockQueue.depth > blockQueue.stat.depthMax) {
+        blockQueue.stat.depthMax = blockQueue.depth;
+    }
+}
+
+static inline bool overlaps(BlockRequest *a, BlockRequest *b) {
+    return a->sector < b->sector + b->count && b->sector < a->sector + a->count;
+}
+
+// The oldest queued request that has to reach the disk before req: one
+// submitted earlier on the same sectors where either of them writes.
+// Otherwise a read could overtake the write of newer data, or two writes
+// could land in the wrong order. req itself if there is none.
+static BlockRequest *orderedBefore(BlockRequest *req) {
+    BlockRequest *r, *first;
+    for (;;) {
+        first = req;
+        LIST_FOREACH(r, &blockQueue.queue, link) {
+            if (r->seq < first->seq && (r->write || req->write) && overlaps(r, req)) {
+                first = r;
+            }
+        }
+        if (first == req) {
+            return req;
+        }
+        req = first;
+    }
+}
+
+// The first request at or after the head position, wrapping around to
+// the lowest sector, unless the oldest one has expired. Either way it
+// does not pass an older request on the same sectors.
+static BlockRequest *pickRequest(void) {
+    BlockRequest *r, *next = NULL, *oldest = NULL;
+    LIST_FOREACH(r, &blockQueue.queue, link) {
+        if (oldest == NULL || r->deadline < oldest->deadline) {
+            oldest = r;
+        }
+        if (next == NULL && r->sector >= blockQueue.position) {
+            next = r;
+        }
+    }
+    if (oldest && oldest->deadline <= r_time()) {
+        blockQueue.stat.expired++;
+        return orderedBefore(oldest);
+    }
+    return orderedBefore(next ? next : LIST_FIRST(&blockQueue.queue));
+}
+
+// Send req and the queued requests continuing it in the same direction
+// to the driver as one command. Called and returns with the lock held.
+static void dispatch(BlockRequest *req) {
+    BlockRequest *run[BMAXRUN];
+    u8 *data[BMAXRUN];
+    u8 **vector = req->data;
+    u64 sector = req->sector;
+    u32 count = 0;
+    int n = 0;
+
+    for (BlockRequest *r = req, *next; r != NULL && n < BMAXRUN; r = next) {
+        next = LIST_NEXT(r, link);
+        if (r->write != req->write || r->sector != sector + count ||
+            (n > 0 && (count + r->count > BMAXRUN || orderedBefore(r) != r))) {
+            break;
+        }
+        LIST_REMOVE(r, link);
+        blockQueue.depth--;
+        if (n > 0) {
+            if (n == 1) {
+                for (u32 i = 0; i < count; i++) {
+                    data[i] = req->data[i];
+                }
+                vector = data;
+            }
+            for (u32 i = 0; i < r->count; i++) {
+                data[count + i] = r->data[i];
+            }
+        }
+        run[n++] = r;
+        count += r->count;
+    }
+
+    blockQueue.position = sector + count;
+    blockQueue.stat.dispatches++;
+    blockQueue.stat.merged += n - 1;
+    blockQueue.stat.sectors += count;
+    releaseLock(&blockQueue.lock);
+
+    int result = req->write ? diskWriteVector(vector, sector, count)
+                            : diskReadVector(vector, sector, count);
+
+    acquireLock(&blockQueue.lock);
+    for (int i = 0; i < n; i++) {
+        run[i]->result = result;
+        run[i]->done = true;
+        wakeup(run[i]);
+    }
+}
+
+// Move count sectors starting at sector between the disk and data[i],
+// one buffer per sector, and wait for the transfer to finish.
+int blockSubmit(bool write, u8 **data, u64 sector, u32 count) {
+    BlockRequest req;
+    req.write = write;
+    req.sector = sector;
+    req.count = count;
+    req.data = data;
+    req.deadline = r_time() + (write ? BLOCK_WRITE_EXPIRE : BLOCK_READ_EXPIRE);
+    req.done = false;
+    req.result = 0;
+
+    acquireLock(&blockQueue.lock);
+    enqueue(&req);
+    while (!req.done) {
+        if (!blockQueue.dispatching) {
+            blockQueue.dispatching = true;
+            while (!req.done) {
+                dispatch(pickRequest());
+            }
+            blockQueue.dispatching = false;
+            // hand the queue to one of the requests still waiting
+            if (!LIST_EMPTY(&blockQueue.queue)) {
+                wakeup(LIST_FIRST(&blockQueue.queue));
+            }
+        } else if (myThread() != NULL) {
+            sleep(&req, &blockQueue.lock);
+        } else {
+            releaseLock(&blockQueue.lock);
+            acquireLock(&blockQueue.lock);
+        }
+    }
+    releaseLock(&blockQueue.lock);
+    return req.result;
+}
@@ -13,6 +13,8 @@
 #include <Sysfile.h>
 #include <Thread.h>
 #include <Riscv.h>
+#include <Page.h>
+#include <Kmalloc.h>
 
 /* fields that start with "_" are something we don't use */
 
@@ -127,27 +129,6 @@ static inline uint32 first_sec_of_clus(FileSystem *fs, uint32 cluster) {
     return ((cluster - 2) * fs->superBlock.bpb.sec_per_clus) + fs->superBlock.first_data_sec;
 }
 
-/**
- * For the given number of a data cluster, return the number of the sector in a
- * FAT table.
- * @param   cluster     number of a data cluster
- * @param   fat_num     number of FAT table from 1, shouldn't be larger than
- * bpb::fat_cnt
- */
-static inline uint32 fat_sec_of_clus(FileSystem *fs, uint32 cluster, uint8 fat_num) {
-    return fs->superBlock.bpb.rsvd_sec_cnt + (cluster << 2) / fs->superBlock.bpb.byts_per_sec +
-           fs->superBlock.bpb.fat_sz * (fat_num - 1);
-}
-
-/**
- * For the given number of a data cluster, return the offest in the
- * corresponding sector in a FAT table.
- * @param   cluster   number of a data cluster
- */
-static inline uint32 fat_offset_of_clus(FileSystem *fs, uint32 cluster) {
-    return (cluster << 2) % fs->superBlock.bpb.byts_per_sec;
-}
-
 /**
  * Read the FAT table content corresponded to the given cluster number.
  * @param   cluster     the number of cluster which you want to read its content
@@ -161,16 +142,13 @@ static uint32 read_fat(FileSystem *fs, uint32 cluster) {
         fs->superBlock.data_clus_cnt + 1) {  // because cluster number starts at 2, not 0
         return 0;
     }
-    uint32 fat_sec = fat_sec_of_clus(fs, cluster, 1);
-    // here should be a cache layer for FAT table, but not implemented yet.
-    struct buf* b = fs->read(fs, fat_sec);
-    uint32 next_clus = *(uint32*)(b->data + fat_offset_of_clus(fs, cluster));
-    brelse(b);
-    return next_clus;
+    return fatTableRead(fs, cluster);
 }
 
 /**
  * Write the FAT region content corresponded to the given cluster number.
+ * The change stays in the FAT cache until fatTableFlush mirrors it to
+ * every FAT on the volume.
  * @param   cluster     the number of cluster to write its content in FAT table
  * @param   content     the content which should be the next cluster number of
  * FAT end of chain flag
@@ -179,12 +157,7 @@ static int write_fat(FileSystem *fs, uint32 cluster, uint32 content) {
     if (cluster > fs->superBlock.data_clus_cnt + 1) {
         return -1;
     }
-    uint32 fat_sec = fat_sec_of_clus(fs, cluster, 1);
-    struct buf* b = fs->read(fs, fat_sec);
-    uint off = fat_offset_of_clus(fs, cluster);
-    *(uint32*)(b->data + off) = content;
-    bwrite(b);
-    brelse(b);
+    fatTableWrite(fs, cluster, content);
     return 0;
 }
 
@@ -199,26 +172,18 @@ static void zero_clus(FileSystem *fs, uint32 cluster) {
     }
 }
 
-static uint32 alloc_clus(FileSystem *fs, uint8 dev) {
-    // should we keep a free cluster list? instead of searching fat every time.
-    struct buf* b;
-    uint32 sec = fs->superBlock.bpb.rsvd_sec_cnt;
-    uint32 const ent_per_sec = fs->superBlock.bpb.byts_per_sec / sizeof(uint32);
-    for (uint32 i = 0; i < fs->superBlock.bpb.fat_sz; i++, sec++) {
-        b = fs->read(fs, sec);
-        for (uint32 j = 0; j < ent_per_sec; j++) {
-            if (((uint32*)(b->data))[j] == 0) {
-                ((uint32*)(b->data))[j] = FAT32_EOC + 7;
-                bwrite(b);
-                brelse(b);
-                uint32 clus = i * ent_per_sec + j;
-                zero_clus(fs, clus);
-                return clus;
-            }
-        }
-        brelse(b);
+/**
+ * Allocate a zeroed cluster and mark it as the end of a chain.
+ * @param   goal    the cluster we would like to get, usually the one right
+ * after the current end of the file, 0 for no preference
+ */
+static uint32 alloc_clus(FileSystem *fs, uint32 goal) {
+    uint32 clus = fatTableAlloc(fs, goal, FAT32_EOC + 7);
+    if (clus == 0) {
+        panic("no clusters");
     }
-    panic("no clusters");
+    zero_clus(fs, clus);
+    return clus;
 }
 
 static void free_clus(FileSystem *fs, uint32 cluster) {
@@ -307,6 +272,116 @@ static uint rw_clus(FileSystem *fs, uint32 cluster,
     return tot;
 }
 
+#define EXTENT_MAX (PAGE_SIZE / sizeof(struct extent))
+
+// Forget the cluster map, e.g. because the chain changed under it.
+static void extent_drop(struct dirent* entry) {
+    if (entry->extents) {
+        kfree(entry->extents);
+        entry->extents = NULL;
+    }
+    entry->extent_cnt = 0;
+    entry->extent_cap = 0;
+    entry->extent_done = 0;
+}
+
+// Make room for one more extent. The map starts with a single one, most
+// files are contiguous, and doubles up to EXTENT_MAX.
+static int extent_grow(struct dirent* entry) {
+    if (entry->extent_cnt < entry->extent_cap) {
+        return 0;
+    }
+    if (entry->extent_cap >= EXTENT_MAX) {
+        return -1;
+    }
+    uint32 cap = entry->extent_cap ? MIN(entry->extent_cap * 2, (uint32)EXTENT_MAX) : 1;
+    struct extent* e = kmalloc(cap * sizeof(struct extent), 0);
+    if (e == NULL) {
+        return -1;
+    }
+    if (entry->extents) {
+        memmove(e, entry->extents, entry->extent_cnt * sizeof(struct extent));
+        kfree(entry->extents);
+    }
+    entry->extents = e;
+    entry->extent_cap = cap;
+    return 0;
+}
+
+// Walk the chain once and record it as runs of contiguous clusters.
+// A chain with more than EXTENT_MAX runs is only mapped partially.
+static int extent_build(FileSystem *fs, struct dirent* entry) {
+    uint32 idx = 0, clus = entry->first_clus;
+    while (clus >= 2 && clus < FAT32_EOC) {
+        struct extent* e = entry->extent_cnt ? &entry->extents[entry->extent_cnt - 1] : NULL;
+        if (e && e->disk_clus + e->len == clus) {
+            e->len++;
+        } else if (extent_grow(entry) == 0) {
+            e = &entry->extents[entry->extent_cnt++];
+            e->file_clus = idx;
+            e->disk_clus = clus;
+            e->len = 1;
+        } else {
+            break;
+        }
+        idx++;
+        clus = read_fat(fs, clus);
+    }
+    if (entry->extents == NULL) {
+        return -1;
+    }
+    entry->extent_done = !(clus >= 2 && clus < FAT32_EOC);
+    return 0;
+}
+
+// A cluster was linked after the last one of the chain, at index clus_num.
+static void extent_append(struct dirent* entry, uint32 clus_num, uint32 clus) {
+    if (!entry->extent_done || entry->extent_cnt == 0) {
+        extent_drop(entry);
+        return;
+    }
+    struct extent* last = &entry->extents[entry->extent_cnt - 1];
+    if (last->file_clus + last->len != clus_num) {
+        extent_drop(entry);
+    } else if (last->disk_clus + last->len == clus) {
+        last->len++;
+    } else if (extent_grow(entry) == 0) {
+        last = &entry->extents[entry->extent_cnt++];
+        last->file_clus = clus_num;
+        last->disk_clus = clus;
+        last->len = 1;
+    } else {
+        entry->extent_done = 0;
+    }
+}
+
+// Move cur_clus to cluster index clus_num, or as close below it as the map
+// goes, with a binary search over the extents.
+static void extent_seek(FileSystem *fs, struct dirent* entry, uint32 clus_num) {
+    if (entry->extents == NULL && extent_build(fs, entry) < 0) {
+        return;
+    }
+    if (entry->extent_cnt == 0) {
+        return;
+    }
+    uint32 lo = 0, hi = entry->extent_cnt - 1;
+    while (lo < hi) {
+        uint32 mid = (lo + hi + 1) / 2;
+        if (entry->extents[mid].file_clus <= clus_num) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    struct extent* e = &entry->extents[lo];
+    uint32 step = clus_num - e->file_clus;
+    if (step >= e->len) {
+        step = e->len - 1;
+    }
+    entry->cur_clus = e->disk_clus + step;
+    entry->clus_cnt = e->file_clus + step;
+}
+
 /**
  * for the given entry, relocate the cur_clus field based on the off
  * @param   entry       modify its cur_clus field
@@ -316,12 +391,19 @@ static uint rw_clus(FileSystem *fs, uint32 cluster,
  */
 static int reloc_clus(FileSystem *fs, struct dirent* entry, uint off, int alloc) {
     int clus_num = off / fs->superBlock.byts_per_clus;
+    if (clus_num < entry->clus_cnt || clus_num > entry->clus_cnt + 1) {
+        // not the next cluster, look it up instead of walking the chain
+        extent_seek(fs, entry, clus_num);
+    }
     while (clus_num > entry->clus_cnt) {
         int clus = read_fat(fs, entry->cur_clus);
         if (clus >= FAT32_EOC) {
             if (alloc) {
-                clus = alloc_clus(fs, entry->dev);
+                clus = alloc_clus(fs, entry->cur_clus + 1);
                 write_fat(fs, entry->cur_clus, clus);
+                if (entry->extents) {
+                    extent_append(entry, entry->clus_cnt + 1, clus);
+                }
             } else {
                 entry->cur_clus = entry->first_clus;
                 entry->clus_cnt = 0;
@@ -345,6 +427,55 @@ static int reloc_clus(FileSystem *fs, struct dirent* entry, uint off, int alloc)
     return off % fs->superBlock.byts_per_clus;
 }
 
+/**
+ * Find the sectors behind [off, off + n) of a cluster chain, extending
+ * over the following clusters while they are physically contiguous, so
+ * the whole run costs one disk command.
+ * @param   cluster     the cluster holding offset off
+ * @param   off         the offset from the beginning of cluster
+ * @param   run         set to the sectors found
+ * @return              the number of bytes from off the run covers, or 0
+ *                      if it is not worth a multi-block read
+ */
+static uint clus_run(FileSystem *fs, uint32 cluster, uint off, uint n,
+                     struct prefetch_run* run) {
+    uint32 const bps = fs->superBlock.bpb.byts_per_sec;
+    uint32 const bpc = fs->superBlock.byts_per_clus;
+    uint end = off + n;
+    uint32 last = cluster;
+    while (end > (last - cluster + 1) * bpc &&
+           (last - cluster + 1) * bpc / bps < BMAXRUN) {
+        if (read_fat(fs, last) != last + 1) {
+            break;
+        }
+        last++;
+    }
+    if (end > (last - cluster + 1) * bpc) {
+        end = (last - cluster + 1) * bpc;
+    }
+    uint count = (end + bps - 1) / bps - off / bps;
+    if (count > BMAXRUN) {
+        count = BMAXRUN;
+    }
+    if (count <= 1 || fs->prefetch == NULL) {
+        return 0;
+    }
+    run->sector = first_sec_of_clus(fs, cluster) + off / bps;
+    run->count = count;
+    return (off / bps + count) * bps - off;
+}
+
+// Bring the run clus_run() finds into the buffer cache.
+// Returns the number of bytes from off that are now cached.
+static uint fetch_clus(FileSystem *fs, uint32 cluster, uint off, uint n) {
+    struct prefetch_run run;
+    uint m = clus_run(fs, cluster, off, n, &run);
+    if (m > 0) {
+        fs->prefetch(fs, run.sector, run.count);
+    }
+    return m;
+}
+
 int getBlockNumber(struct dirent* entry, int dataBlockNum) {
     int offset = (dataBlockNum << 9);
     if (offset > entry->file_size) {
@@ -375,9 +506,14 @@ int eread(struct dirent* entry, int user_dst, u64 dst, uint off, uint n) {
 
     FileSystem *fs = entry->fileSystem;
     uint tot, m;
+    uint cached = off;  // data below this offset has just been prefetched
     for (tot = 0; entry->cur_clus < FAT32_EOC && tot < n;
          tot += m, off += m, dst += m) {
         reloc_clus(fs, entry, off, 0);
+        if (off >= cached) {
+            cached = off + fetch_clus(fs, entry->cur_clus,
+                off % fs->superBlock.byts_per_clus, n - tot);
+        }
         m = fs->superBlock.byts_per_clus - off % fs->superBlock.byts_per_clus;
         if (n - tot < m) {
             m = n - tot;
@@ -390,6 +526,43 @@ int eread(struct dirent* entry, int user_dst, u64 dst, uint off, uint n) {
     return tot;
 }
 
+// Find the disk runs behind [off, off + n) of the file, at most max of
+// them, so the caller can prefetch them with fs->prefetch once it has
+// dropped entry->lock, without holding up other users of the file. The
+// cluster cursor is left where it was, so the reader does not have to
+// walk the chain again from first_clus. *nrun is set to the number of
+// runs; returns how many bytes from off they account for.
+// Caller must hold entry->lock.
+uint eprefetch(struct dirent* entry, uint off, uint n,
+               struct prefetch_run* runs, int max, int* nrun) {
+    *nrun = 0;
+    if (entry->dev == ZERO || off >= entry->file_size ||
+        (entry->attribute & ATTR_DIRECTORY)) {
+        return 0;
+    }
+    if (off + n > entry->file_size || off + n < off) {
+        n = entry->file_size - off;
+    }
+
+    FileSystem *fs = entry->fileSystem;
+    uint32 const bpc = fs->superBlock.byts_per_clus;
+    uint32 cur_clus = entry->cur_clus;
+    uint clus_cnt = entry->clus_cnt;
+    uint done = 0;
+    while (done < n && *nrun < max && reloc_clus(fs, entry, off + done, 0) >= 0) {
+        uint m = clus_run(fs, entry->cur_clus, (off + done) % bpc, n - done, &runs[*nrun]);
+        if (m > 0) {
+            (*nrun)++;
+        } else {
+            m = bpc - (off + done) % bpc;
+        }
+        done += MIN(m, n - done);
+    }
+    entry->cur_clus = cur_clus;
+    entry->clus_cnt = clus_cnt;
+    return done;
+}
+
 // Caller must hold entry->lock.
 int ewrite(struct dirent* entry, int user_src, u64 src, uint off, uint n) {
     if (off > entry->file_size || off + n < off ||
@@ -399,7 +572,8 @@ int ewrite(struct dirent* entry, int user_src, u64 src, uint off, uint n) {
     FileSystem *fs = entry->fileSystem;
     if (entry->first_clus ==
         0) {  // so file_size if 0 too, which requests off == 0
-        entry->cur_clus = entry->first_clus = alloc_clus(fs, entry->dev);
+        extent_drop(entry);
+        entry->cur_clus = entry->first_clus = alloc_clus(fs, 0);
         entry->clus_cnt = 0;
         entry->dirty = 1;
     }
@@ -414,6 +588,7 @@ int ewrite(struct dirent* entry, int user_src, u64 src, uint off, uint n) {
             off % fs->superBlock.byts_per_clus, m) != m) {
             break;
         }
+        bthrottle();
     }
     if (n > 0) {
         if (off > entry->file_size) {
@@ -424,43 +599,202 @@ int ewrite(struct dirent* entry, int user_src, u64 src, uint off, uint n) {
     return tot;
 }
 
+#define IN_ECACHE(ep) \
+    ((ep) >= direntCache.entries && (ep) < direntCache.entries + ENTRY_CACHE_NUM)
+
+static uint32 ecache_hash(struct dirent* parent, char* name) {
+    uint32 h = 2166136261u ^ (uint32)((u64)parent >> 4);
+    for (int i = 0; i < FAT32_MAX_FILENAME && name[i]; i++) {
+        h = (h ^ (uint8)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// caller must hold direntCache.lock
+static void ecache_lru_del(struct dirent* ep) {
+    ep->lru_next->lru_prev = ep->lru_prev;
+    ep->lru_prev->lru_next = ep->lru_next;
+}
+
+// Entries that still name a file go to the head; the rest are handed out
+// first by eget(). caller must hold direntCache.lock
+static void ecache_lru_add(struct dirent* ep) {
+    struct dirent* head = &direntCache.lru;
+    if (ep->valid == 1) {
+        ep->lru_next = head->lru_next;
+        ep->lru_prev = head;
+    } else {
+        ep->lru_next = head;
+        ep->lru_prev = head->lru_prev;
+    }
+    ep->lru_next->lru_prev = ep;
+    ep->lru_prev->lru_next = ep;
+}
+
+// caller must hold direntCache.lock
+static void ecache_ref(struct dirent* ep) {
+    if (ep->ref++ == 0 && IN_ECACHE(ep)) {
+        ecache_lru_del(ep);
+    }
+}
+
+// caller must hold direntCache.lock
+static void ecache_unhash(struct dirent* ep) {
+    if (!ep->hashed) {
+        return;
+    }
+    struct dirent** pp = &direntCache.hash[ep->name_hash % ENTRY_HASH_NUM];
+    while (*pp != ep) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = ep->hash_next;
+    ep->hashed = 0;
+    ep->parent->children--;
+}
+
+// Forget absent names under parent, or every one if parent is NULL.
+// caller must hold direntCache.lock
+static void negative_purge(struct dirent* parent, uint32 hash, char* name) {
+    for (int i = 0; i < NEGATIVE_CACHE_NUM; i++) {
+        NegativeDirent* nd = &direntCache.negative[i];
+        if (nd->parent == NULL || (parent && nd->parent != parent)) {
+            continue;
+        }
+        if (name == NULL ||
+            (nd->hash == hash && strncmp(nd->name, name, FAT32_MAX_FILENAME) == 0)) {
+            nd->parent = NULL;
+        }
+    }
+}
+
+static bool negative_find(struct dirent* parent, char* name) {
+    uint32 hash = ecache_hash(parent, name);
+    acquireLock(&direntCache.lock);
+    for (int i = 0; i < NEGATIVE_CACHE_NUM; i++) {
+        NegativeDirent* nd = &direntCache.negative[i];
+        if (nd->parent == parent && nd->hash == hash &&
+            strncmp(nd->name, name, FAT32_MAX_FILENAME) == 0) {
+            direntCache.stat.negativeHits++;
+            releaseLock(&direntCache.lock);
+            return true;
+        }
+    }
+    releaseLock(&direntCache.lock);
+    return false;
+}
+
+static void negative_add(struct dirent* parent, char* name) {
+    uint32 hash = ecache_hash(parent, name);
+    acquireLock(&direntCache.lock);
+    NegativeDirent* nd = &direntCache.negative[direntCache.negativeNext];
+    direntCache.negativeNext = (direntCache.negativeNext + 1) % NEGATIVE_CACHE_NUM;
+    nd->parent = parent;
+    nd->hash = hash;
+    strncpy(nd->name, name, FAT32_MAX_FILENAME);
+    nd->name[FAT32_MAX_FILENAME] = '\0';
+    releaseLock(&direntCache.lock);
+}
+
+// Index a valid entry by (parent, filename) so that eget() can find it.
+void ehash(struct dirent* entry) {
+    acquireLock(&direntCache.lock);
+    if (IN_ECACHE(entry) && !entry->hashed) {
+        entry->name_hash = ecache_hash(entry->parent, entry->filename);
+        negative_purge(entry->parent, entry->name_hash, entry->filename);
+        struct dirent** head = &direntCache.hash[entry->name_hash % ENTRY_HASH_NUM];
+        entry->hash_next = *head;
+        *head = entry;
+        entry->hashed = 1;
+        entry->parent->children++;
+    }
+    releaseLock(&direntCache.lock);
+}
+
+// Drop everything cached about fs before it goes away. Entries still
+// referenced are left alone; returns how many of them there are, the
+// root of fs counting when anyone besides fs itself holds it.
+int epurge(FileSystem* fs) {
+    acquireLock(&direntCache.lock);
+    for (int i = 0; i < NEGATIVE_CACHE_NUM; i++) {
+        NegativeDirent* nd = &direntCache.negative[i];
+        if (nd->parent && nd->parent->fileSystem == fs) {
+            nd->parent = NULL;
+        }
+    }
+    // children come before their parents, so repeat until nothing changes
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (struct dirent* ep = direntCache.entries;
+             ep < direntCache.entries + ENTRY_CACHE_NUM; ep++) {
+            if (ep->fileSystem == fs && ep->ref == 0 && ep->hashed &&
+                ep->children == 0) {
+                ecache_unhash(ep);
+                ep->valid = 0;
+                ecache_lru_del(ep);
+                ecache_lru_add(ep);
+                changed = true;
+            }
+        }
+    }
+    int busy = fs->root.ref > 1;
+    for (struct dirent* ep = direntCache.entries;
+         ep < direntCache.entries + ENTRY_CACHE_NUM; ep++) {
+        if (ep->fileSystem == fs && ep->ref > 0) {
+            busy++;
+        }
+    }
+    releaseLock(&direntCache.lock);
+    return busy;
+}
+
 // Returns a dirent struct. If name is given, check ecache. It is difficult to
 // cache entries by their whole path. But when parsing a path, we open all the
 // directories through it, which forms a linked list from the final file to the
 // root. Thus, we use the "parent" pointer to recognize whether an entry with
 // the "name" as given is really the file we want in the right path. Should
 // never get root by eget, it's easy to understand.
+// Valid entries are hashed by (parent, name). A miss recycles the least
+// recently released entry that no cached child still points at.
 static struct dirent* eget(struct dirent* parent, char* name) {
     struct dirent* ep;
     acquireLock(&direntCache.lock);
     if (name) {
-        for (int i = 0; i < ENTRY_CACHE_NUM; i++) {
-            ep = &direntCache.entries[i];
-            if (ep->valid == 1 && ep->parent == parent &&
+        uint32 hash = ecache_hash(parent, name);
+        for (ep = direntCache.hash[hash % ENTRY_HASH_NUM]; ep; ep = ep->hash_next) {
+            if (ep->name_hash == hash && ep->valid == 1 && ep->parent == parent &&
                 strncmp(ep->filename, name, FAT32_MAX_FILENAME) == 0) {
-                if (ep->ref++ == 0) {
-                    ep->parent->ref++;
+                if (ep->ref == 0) {
+                    ecache_ref(ep->parent);
                 }
+                ecache_ref(ep);
+                direntCache.stat.hits++;
                 releaseLock(&direntCache.lock);
                 return ep;
             }
         }
+        direntCache.stat.misses++;
     }
-    for (int i = 0; i < ENTRY_CACHE_NUM; i++) {
-        ep = &direntCache.entries[i];
-        if (ep->ref == 0) {
-            ep->ref = 1;
-            ep->dev = parent->dev;
-            ep->off = 0;
-            ep->valid = 0;
-            ep->dirty = 0;
-            ep->fileSystem = parent->fileSystem;
-            releaseLock(&direntCache.lock);
-            return ep;
+    for (ep = direntCache.lru.lru_prev; ep != &direntCache.lru; ep = ep->lru_prev) {
+        if (ep->children == 0) {
+            break;
         }
     }
-    panic("eget: insufficient ecache");
-    return 0;
+    if (ep == &direntCache.lru) {
+        panic("eget: insufficient ecache");
+    }
+    ecache_lru_del(ep);
+    ecache_unhash(ep);
+    negative_purge(ep, 0, NULL);
+    ep->ref = 1;
+    extent_drop(ep);
+    ep->dev = parent->dev;
+    ep->off = 0;
+    ep->valid = 0;
+    ep->dirty = 0;
+    ep->fileSystem = parent->fileSystem;
+    releaseLock(&direntCache.lock);
+    return ep;
 }
 
 // trim ' ' in the head and tail, '.' in head, and test legality
@@ -662,7 +996,7 @@ struct dirent* ealloc(struct dirent* dp, char* name, int attr) {
     FileSystem *fs = ep->fileSystem;
     if (attr == ATTR_DIRECTORY) {  // generate "." and ".." for ep
         ep->attribute |= ATTR_DIRECTORY;
-        ep->cur_clus = ep->first_clus = alloc_clus(fs, dp->dev);
+        ep->cur_clus = ep->first_clus = alloc_clus(fs, 0);
         emake(ep, ep, 0);
         emake(ep, dp, 32);
     } else {
@@ -670,6 +1004,7 @@ struct dirent* ealloc(struct dirent* dp, char* name, int attr) {
     }
     emake(dp, ep, off);
     ep->valid = 1;
+    ehash(ep);
     eunlock(ep);
     return ep;
 }
@@ -678,7 +1013,7 @@ struct dirent* edup(struct dirent* entry) {
     
     if (entry != 0) {
         acquireLock(&direntCache.lock);
-        entry->ref++;
+        ecache_ref(entry);
         releaseLock(&direntCache.lock);
     }
     
@@ -760,7 +1095,10 @@ void eremove(struct dirent* entry) {
         off += 32;
         off2 = reloc_clus(fs, entry->parent, off, 0);
     }
+    acquireLock(&direntCache.lock);
+    ecache_unhash(entry);
     entry->valid = -1;
+    releaseLock(&direntCache.lock);
 }
 
 // truncate a file
@@ -770,8 +1108,10 @@ void etrunc(struct dirent* entry) {
     for (uint32 clus = entry->first_clus; clus >= 2 && clus < FAT32_EOC;) {
         uint32 next = read_fat(fs, clus);
         free_clus(fs, clus);
+        bthrottle();
         clus = next;
     }
+    extent_drop(entry);
     entry->file_size = 0;
     entry->first_clus = 0;
     entry->dirty = 1;
@@ -818,15 +1158,20 @@ void eput(struct dirent* entry) {
         // entry away and write it.
         struct dirent* eparent = entry->parent;
         acquireLock(&direntCache.lock);
-        entry->ref--;
+        int ref = --entry->ref;
+        if (ref == 0) {
+            ecache_lru_add(entry);
+        }
         releaseLock(&direntCache.lock);
-        if (entry->ref == 0) {
+        if (ref == 0) {
             eput(eparent);
         }
         return;
     }
     MSG_PRINT("end of eput");
-    entry->ref--;
+    if (--entry->ref == 0 && IN_ECACHE(entry)) {
+        ecache_lru_add(entry);
+    }
     releaseLock(&direntCache.lock);
 }
 
@@ -918,6 +1263,11 @@ static void read_entry_info(struct dirent* entry, union dentry* d) {
     entry->file_size = d->sne.file_size;
     entry->cur_clus = entry->first_clus;
     entry->clus_cnt = 0;
+    // entry is fresh from eget or a scratch copy, it owns no map
+    entry->extents = NULL;
+    entry->extent_cnt = 0;
+    entry->extent_cap = 0;
+    entry->extent_done = 0;
     entry->_nt_res = d->sne._nt_res;
 }
 
@@ -1004,6 +1354,10 @@ struct dirent* dirlookup(struct dirent* dp, char* filename, uint* poff) {
     if (dp->valid != 1) {
         return NULL;
     }
+    // a caller asking for a free slot needs the full scan below
+    if (poff == NULL && negative_find(dp, filename)) {
+        return NULL;
+    }
     
     struct dirent* ep = eget(dp, filename);
     if (ep->valid == 1) {
@@ -1030,6 +1384,7 @@ struct dirent* dirlookup(struct dirent* dp, char* filename, uint* poff) {
             ep->parent = edup(dp);
             ep->off = off;
             ep->valid = 1;
+            ehash(ep);
             return ep;
         }
         off += count << 5;
@@ -1037,6 +1392,7 @@ struct dirent* dirlookup(struct dirent* dp, char* filename, uint* poff) {
     if (poff) {
         *poff = off;
     }
+    negative_add(dp, filename);
     eput(ep);
     return NULL;
 }
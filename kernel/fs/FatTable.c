@@ -0,0 +1,404 @@
+// FAT table cache.
+//
+// Windows of FAT_WINDOW_SECTORS consecutive FAT sectors are kept in
+// memory, so following a cluster chain does not go through bread and
+// brelse for every step. Updates only change the cached copy and mark
+// the sector dirty; fatTableFlush writes dirty sectors back to every
+// FAT copy on the volume.
+//
+// Allocation uses a bitmap of free clusters built from the FAT the first
+// time a cluster is allocated, and starts searching at the next-free
+// hint kept in the FSInfo sector.
+#include <FileSystem.h>
+#include <FatTable.h>
+#include <Page.h>
+#include <Driver.h>
+#include <string.h>
+
+#define ENTRIES_PER_SECTOR (BSIZE / sizeof(u32))
+
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_FREE_COUNT 488
+#define FSINFO_NEXT_FREE 492
+
+static inline bool fsinfoValid(struct buf* b) {
+    return *(u32*)b->data == FSINFO_LEAD_SIG &&
+           *(u32*)(b->data + 484) == FSINFO_STRUC_SIG;
+}
+
+void fatTableInit(FileSystem* fs, u16 infoSector) {
+    FatTable* ft = &fs->fatTable;
+    initsleeplock(&ft->lock, "fatTable");
+    for (int i = 0; i < FAT_WINDOW_NUM; i++) {
+        ft->window[i].sector = FAT_WINDOW_NONE;
+        ft->window[i].entries = NULL;
+        ft->window[i].dirty = 0;
+        ft->window[i].lastUse = 0;
+    }
+    ft->hint = 0;
+    ft->clock = 0;
+
+    ft->freeMap = NULL;
+    ft->freeCount = 0;
+    ft->nextFree = 2;
+    ft->infoSector = 0;
+    ft->infoDirty = false;
+    if (infoSector == 0 || infoSector == 0xffff) {
+        return;
+    }
+    struct buf* b = fs->read(fs, infoSector);
+    if (fsinfoValid(b)) {
+        u32 next = *(u32*)(b->data + FSINFO_NEXT_FREE);
+        if (next >= 2 && next <= fs->superBlock.data_clus_cnt + 1) {
+            ft->nextFree = next;
+        }
+        ft->infoSector = infoSector;
+    }
+    brelse(b);
+}
+
+// Mirror the dirty sectors of w into all FATs.
+// Caller holds fs->fatTable.lock.
+static void windowFlush(FileSystem* fs, FatWindow* w) {
+    for (int i = 0; w->dirty; i++) {
+        if (!(w->dirty & (1 << i))) {
+            continue;
+        }
+        for (int k = 0; k < fs->superBlock.bpb.fat_cnt; k++) {
+            struct buf* b = fs->read(fs, fs->superBlock.bpb.rsvd_sec_cnt +
+                                         k * fs->superBlock.bpb.fat_sz +
+                                         w->sector + i);
+            memmove(b->data, (u8*)w->entries + i * BSIZE, BSIZE);
+            bwrite(b);
+            brelse(b);
+        }
+        w->dirty &= ~(1 << i);
+    }
+}
+
+// Caller holds fs->fatTable.lock.
+static void windowLoad(FileSystem* fs, FatWindow* w, u32 base) {
+    if (w->entries == NULL) {
+        PhysicalPage* page;
+        if (pageAlloc(&page) < 0) {
+            panic("fat table: no memory");
+        }
+        w->entries = (u32*)page2pa(page);
+    }
+    windowFlush(fs, w);
+
+    u32 count = MIN((u32)FAT_WINDOW_SECTORS, fs->superBlock.bpb.fat_sz - base);
+    u32 first = fs->superBlock.bpb.rsvd_sec_cnt + base;
+    if (fs->prefetch) {
+        fs->prefetch(fs, first, count);
+    }
+    for (u32 i = 0; i < count; i++) {
+        struct buf* b = fs->read(fs, first + i);
+        memmove((u8*)w->entries + i * BSIZE, b->data, BSIZE);
+        brelse(b);
+    }
+    w->sector = base;
+}
+
+// Return the window holding FAT sector `sector`, loading it over the
+// least recently used window on a miss.
+// Caller holds fs->fatTable.lock.
+static FatWindow* windowGet(FileSystem* fs, u32 sector) {
+    FatTable* ft = &fs->fatTable;
+    u32 base = sector - sector % FAT_WINDOW_SECTORS;
+    FatWindow* w = &ft->window[ft->hint];
+
+    if (w->sector != base) {
+        FatWindow* victim = &ft->window[0];
+        int i;
+        for (i = 0; i < FAT_WINDOW_NUM; i++) {
+            w = &ft->window[i];
+            if (w->sector == base) {
+                break;
+            }
+            if (w->lastUse < victim->lastUse) {
+                victim = w;
+            }
+        }
+        if (i == FAT_WINDOW_NUM) {
+            w = victim;
+            windowLoad(fs, w, base);
+        }
+        ft->hint = w - ft->window;
+    }
+    w->lastUse = ++ft->clock;
+    return w;
+}
+
+static inline u32* entryOf(FatWindow* w, u32 cluster) {
+    return &w->entries[cluster - w->sector * ENTRIES_PER_SECTOR];
+}
+
+static inline u64* mapWord(FatTable* ft, u32 cluster) {
+    return &ft->freeMap[cluster / FAT_MAP_BITS][cluster % FAT_MAP_BITS / 64];
+}
+
+static inline bool mapFree(FatTable* ft, u32 cluster) {
+    return (*mapWord(ft, cluster) >> (cluster % 64)) & 1;
+}
+
+static void mapSet(FatTable* ft, u32 cluster, bool free) {
+    u64* word = mapWord(ft, cluster);
+    u64 bit = 1UL << (cluster % 64);
+    if (free && !(*word & bit)) {
+        *word |= bit;
+        ft->freeCount++;
+    } else if (!free && (*word & bit)) {
+        *word &= ~bit;
+        ft->freeCount--;
+    }
+}
+
+// First free cluster in [from, to], or 0 if there is none.
+static u32 mapNext(FatTable* ft, u32 from, u32 to) {
+    u32 cluster = from;
+    while (cluster <= to) {
+        u64 word = *mapWord(ft, cluster) >> (cluster % 64);
+        if (word == 0) {
+            cluster = (cluster | 63) + 1;
+            continue;
+        }
+        while (!(word & 1)) {
+            word >>= 1;
+            cluster++;
+        }
+        return cluster <= to ? cluster : 0;
+    }
+    return 0;
+}
+
+static void mapRelease(FatTable* ft) {
+    if (ft->freeMap == NULL) {
+        return;
+    }
+    for (int i = 0; i < PAGE_SIZE / sizeof(u64*) && ft->freeMap[i]; i++) {
+        pageFree(pa2page((u64)ft->freeMap[i]));
+    }
+    pageFree(pa2page((u64)ft->freeMap));
+    ft->freeMap = NULL;
+}
+
+// Build the free-cluster bitmap from the FAT. Sectors cached in a window
+// may be newer than the disk and are taken from there.
+// Caller holds fs->fatTable.lock.
+static int mapBuild(FileSystem* fs) {
+    FatTable* ft = &fs->fatTable;
+    u32 const last = fs->superBlock.data_clus_cnt + 1;
+    u32 const npages = last / FAT_MAP_BITS + 1;
+    u32 const nsec = last / ENTRIES_PER_SECTOR + 1;
+    u32 const first = fs->superBlock.bpb.rsvd_sec_cnt;
+    PhysicalPage* page;
+
+    if (npages > PAGE_SIZE / sizeof(u64*) || pageAlloc(&page) < 0) {
+        return -1;
+    }
+    ft->freeMap = (u64**)page2pa(page);
+    for (u32 i = 0; i < npages; i++) {
+        if (pageAlloc(&page) < 0) {
+            mapRelease(ft);
+            return -1;
+        }
+        ft->freeMap[i] = (u64*)page2pa(page);
+    }
+
+    ft->freeCount = 0;
+    for (u32 sec = 0; sec < nsec; sec++) {
+        struct buf* b = NULL;
+        u32* entries = NULL;
+        for (int i = 0; i < FAT_WINDOW_NUM; i++) {
+            FatWindow* w = &ft->window[i];
+            if (w->sector != FAT_WINDOW_NONE && sec >= w->sector &&
+                sec < w->sector + FAT_WINDOW_SECTORS) {
+                entries = w->entries + (sec - w->sector) * ENTRIES_PER_SECTOR;
+                break;
+            }
+        }
+        if (entries == NULL) {
+            if (sec % BMAXRUN == 0 && fs->prefetch) {
+                fs->prefetch(fs, first + sec, MIN((u32)BMAXRUN, nsec - sec));
+            }
+            b = fs->read(fs, first + sec);
+            entries = (u32*)b->data;
+        }
+        for (u32 j = 0; j < ENTRIES_PER_SECTOR; j++) {
+            u32 cluster = sec * ENTRIES_PER_SECTOR + j;
+            if (cluster >= 2 && cluster <= last &&
+                (entries[j] & 0x0fffffff) == 0) {
+                mapSet(ft, cluster, true);
+            }
+        }
+        if (b) {
+            brelse(b);
+        }
+    }
+    return 0;
+}
+
+// Pick a free cluster: goal if it is free, so a file grows contiguously,
+// otherwise the start of a run of FAT_ALLOC_RUN free clusters at or after
+// the next-free hint, otherwise the first free cluster found.
+// Caller holds fs->fatTable.lock.
+static u32 mapAlloc(FileSystem* fs, u32 goal) {
+    FatTable* ft = &fs->fatTable;
+    u32 const last = fs->superBlock.data_clus_cnt + 1;
+    u32 start = ft->nextFree, found = 0;
+
+    if (goal >= 2 && goal <= last && mapFree(ft, goal)) {
+        return goal;
+    }
+    if (start < 2 || start > last) {
+        start = 2;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        u32 to = pass == 0 ? last : start - 1;
+        u32 cluster = pass == 0 ? start : 2;
+        while ((cluster = mapNext(ft, cluster, to)) != 0) {
+            u32 end = cluster + 1;
+            while (end <= to && end - cluster < FAT_ALLOC_RUN && mapFree(ft, end)) {
+                end++;
+            }
+            if (end - cluster == FAT_ALLOC_RUN) {
+                return cluster;
+            }
+            if (found == 0) {
+                found = cluster;
+            }
+            cluster = end;
+        }
+    }
+    return found;
+}
+
+// Linear search used when the bitmap could not be built.
+// Caller holds fs->fatTable.lock.
+static u32 scanAlloc(FileSystem* fs) {
+    u32 const last = fs->superBlock.data_clus_cnt + 1;
+    u32 cluster = fs->fatTable.nextFree;
+    FatWindow* w = NULL;
+
+    if (cluster < 2 || cluster > last) {
+        cluster = 2;
+    }
+    for (u32 n = 0; n < last - 1; n++, cluster++) {
+        if (cluster > last) {
+            cluster = 2;
+        }
+        u32 sector = cluster / ENTRIES_PER_SECTOR;
+        if (w == NULL || sector < w->sector ||
+            sector >= w->sector + FAT_WINDOW_SECTORS) {
+            w = windowGet(fs, sector);
+        }
+        if ((*entryOf(w, cluster) & 0x0fffffff) == 0) {
+            return cluster;
+        }
+    }
+    return 0;
+}
+
+// Caller holds fs->fatTable.lock.
+static void entrySet(FileSystem* fs, u32 cluster, u32 content) {
+    FatTable* ft = &fs->fatTable;
+    u32 sector = cluster / ENTRIES_PER_SECTOR;
+    FatWindow* w = windowGet(fs, sector);
+    *entryOf(w, cluster) = content;
+    w->dirty |= 1 << (sector - w->sector);
+    if (ft->freeMap) {
+        mapSet(ft, cluster, (content & 0x0fffffff) == 0);
+        ft->infoDirty = true;
+    }
+}
+
+u32 fatTableRead(FileSystem* fs, u32 cluster) {
+    acquiresleep(&fs->fatTable.lock);
+    FatWindow* w = windowGet(fs, cluster / ENTRIES_PER_SECTOR);
+    u32 content = *entryOf(w, cluster);
+    releasesleep(&fs->fatTable.lock);
+    return content;
+}
+
+void fatTableWrite(FileSystem* fs, u32 cluster, u32 content) {
+    acquiresleep(&fs->fatTable.lock);
+    entrySet(fs, cluster, content);
+    releasesleep(&fs->fatTable.lock);
+}
+
+// Claim a free cluster, preferring goal, and set its entry to content.
+// Return 0 when the volume is full.
+u32 fatTableAlloc(FileSystem* fs, u32 goal, u32 content) {
+    FatTable* ft = &fs->fatTable;
+    u32 cluster;
+
+    acquiresleep(&ft->lock);
+    if (ft->freeMap || mapBuild(fs) == 0) {
+        cluster = mapAlloc(fs, goal);
+    } else {
+        cluster = scanAlloc(fs);
+    }
+    if (cluster != 0) {
+        entrySet(fs, cluster, content);
+        ft->nextFree = cluster + 1;
+        ft->infoDirty = true;
+    }
+    releasesleep(&ft->lock);
+    return cluster;
+}
+
+u32 fatTableFreeCount(FileSystem* fs) {
+    FatTable* ft = &fs->fatTable;
+    u32 count = 0;
+    acquiresleep(&ft->lock);
+    if (ft->freeMap || mapBuild(fs) == 0) {
+        count = ft->freeCount;
+    }
+    releasesleep(&ft->lock);
+    return count;
+}
+
+// Record the free count and next-free hint in FSInfo.
+// Caller holds fs->fatTable.lock.
+static void infoFlush(FileSystem* fs) {
+    FatTable* ft = &fs->fatTable;
+    if (!ft->infoDirty || ft->infoSector == 0) {
+        return;
+    }
+    struct buf* b = fs->read(fs, ft->infoSector);
+    if (fsinfoValid(b)) {
+        *(u32*)(b->data + FSINFO_FREE_COUNT) = ft->freeMap ? ft->freeCount : 0xffffffff;
+        *(u32*)(b->data + FSINFO_NEXT_FREE) = ft->nextFree;
+        bwrite(b);
+    }
+    brelse(b);
+    ft->infoDirty = false;
+}
+
+void fatTableFlush(FileSystem* fs) {
+    acquiresleep(&fs->fatTable.lock);
+    for (int i = 0; i < FAT_WINDOW_NUM; i++) {
+        windowFlush(fs, &fs->fatTable.window[i]);
+    }
+    infoFlush(fs);
+    releasesleep(&fs->fatTable.lock);
+}
+
+// Flush and drop every window, used when the file system goes away.
+void fatTableFree(FileSystem* fs) {
+    acquiresleep(&fs->fatTable.lock);
+    for (int i = 0; i < FAT_WINDOW_NUM; i++) {
+        FatWindow* w = &fs->fatTable.window[i];
+        windowFlush(fs, w);
+        if (w->entries) {
+            pageFree(pa2page((u64)w->entries));
+            w->entries = NULL;
+        }
+        w->sector = FAT_WINDOW_NONE;
+    }
+    infoFlush(fs);
+    mapRelease(&fs->fatTable);
+    releasesleep(&fs->fatTable.lock);
+}
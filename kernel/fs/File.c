@@ -2,6 +2,7 @@
 // Support functions for system calls that involve file descriptors.
 //
 #include "fat.h"
+#include <FileSystem.h>
 #include <file.h>
 #include <Process.h>
 #include <Page.h>
@@ -12,35 +13,26 @@
 #include <Debug.h>
 #include <Socket.h>
 #include <Mmap.h>
+#include <Kmalloc.h>
 
 struct devsw devsw[NDEV];
+// File structures come from kmalloc, the lock guards their ref counts.
 struct {
     struct Spinlock lock;
-    struct File file[NFILE];
 } ftable;
 
 void fileinit(void) {
     initLock(&ftable.lock, "ftable");
-    struct File* f;
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        memset(f, 0, sizeof(struct File));
-    }
 }
 
 // Allocate a file structure.
 struct File* filealloc(void) {
-    struct File* f;
-
-    acquireLock(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            releaseLock(&ftable.lock);
-            return f;
-        }
+    struct File* f = kmalloc(sizeof(struct File), KMALLOC_ZERO);
+    if (f == NULL) {
+        return NULL;
     }
-    releaseLock(&ftable.lock);
-    return NULL;
+    f->ref = 1;
+    return f;
 }
 
 // Increment ref count for file f.
@@ -66,9 +58,8 @@ void fileclose(struct File* f) {
         return;
     }
     ff = *f;
-    f->ref = 0;
-    f->type = FD_NONE;
     releaseLock(&ftable.lock);
+    kfree(f);
 
     // printf("FILECLOSE %x\n", ff.type);
     if (ff.type == FD_PIPE) {
@@ -98,6 +89,34 @@ int filestat(struct File* f, u64 addr) {
     return -1;
 }
 
+#define READ_AHEAD_RUNS 16
+
+// Grow the read-ahead window while f is read sequentially and find the
+// disk runs holding the data after f->off, to be pulled into the buffer
+// cache before it is asked for. start is where the read that just
+// finished began. Returns the number of runs put in runs.
+// Caller holds f->ep->lock.
+static int readahead(struct File* f, uint start, struct prefetch_run* runs) {
+    if (start == f->raPrev && f->off > start) {
+        f->raWindow = f->raWindow ? MIN(f->raWindow * 2, READ_AHEAD_MAX)
+                                  : READ_AHEAD_MIN;
+    } else {
+        f->raWindow = 0;
+        f->raEnd = f->off;
+    }
+    f->raPrev = f->off;
+
+    // Refill once half of what was read ahead has been consumed.
+    int nrun = 0;
+    if (f->raWindow && f->off + f->raWindow / 2 >= f->raEnd) {
+        uint from = f->raEnd > f->off ? f->raEnd : f->off;
+        uint to = f->off + f->raWindow;
+        f->raEnd = from + eprefetch(f->ep, from, to - from, runs,
+                                    READ_AHEAD_RUNS, &nrun);
+    }
+    return nrun;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int fileread(struct File* f, u64 addr, int n) {
@@ -115,12 +134,21 @@ int fileread(struct File* f, u64 addr, int n) {
                 return -1;
             r = devsw[f->major].read(1, addr, 0, n);
             break;
-        case FD_ENTRY:
+        case FD_ENTRY: {
+            struct prefetch_run runs[READ_AHEAD_RUNS];
+            uint start = f->off;
             elock(f->ep);
             if ((r = eread(f->ep, 1, addr, f->off, n)) > 0)
                 f->off += r;
+            int nrun = readahead(f, start, runs);
             eunlock(f->ep);
+            // other users of the file need not wait for the read-ahead
+            FileSystem* fs = f->ep->fileSystem;
+            for (int i = 0; i < nrun; i++) {
+                fs->prefetch(fs, runs[i].sector, runs[i].count);
+            }
             break;
+        }
         default:
             panic("fileread");
     }
@@ -197,7 +225,13 @@ u64 do_mmap(struct File* fd, u64 start, u64 len, int perm, int flags, u64 off) {
     }
     u64 addr = start, end = start + len;
     start = DOWN_ALIGN(start, 12);
+    bool anonymous = fd == NULL || (flags & MAP_ANONYMOUS);
     while (start < end) {
+        if (anonymous && start + MEGA_PAGE_SIZE <= end &&
+            pageInsertHuge(myProcess()->pgdir, start, perm | PTE_USER | PTE_READ | PTE_WRITE | PTE_EXECUTE) == 0) {
+            start += MEGA_PAGE_SIZE;
+            continue;
+        }
         u64* pte;
         u64 pa = pageLookup(myProcess()->pgdir, start, &pte);
         if (pa > 0 && (*pte & PTE_COW)) {
@@ -5,20 +5,33 @@
 #include <Driver.h>
 #include <file.h>
 #include <Sysfile.h>
-FileSystem fileSystem[32];
+FileSystem fileSystem[FILE_SYSTEM_NUM];
+// Guards the valid flag of every fileSystem[] slot. It is a sleep lock
+// because fsSync holds it while writing FAT tables back, so that no
+// slot is cleared and reused under it.
+static struct Sleeplock fsLock;
 
 int fsAlloc(FileSystem **fs) {
-    for (int i = 0; i < 32; i++) {
+    acquiresleep(&fsLock);
+    for (int i = 0; i < FILE_SYSTEM_NUM; i++) {
         if (!fileSystem[i].valid) {
             *fs = &fileSystem[i];
             memset(*fs, 0, sizeof(FileSystem));
             fileSystem[i].valid = true;
+            releasesleep(&fsLock);
             return 0;
         }
     }
+    releasesleep(&fsLock);
     return -1;
 }
 
+void fsFree(FileSystem *fs) {
+    acquiresleep(&fsLock);
+    fs->valid = false;
+    releasesleep(&fsLock);
+}
+
 DirentCache direntCache;
 // fs's read, name, mount_point should be inited
 int fatInit(FileSystem *fs) {
@@ -39,6 +52,7 @@ int fatInit(FileSystem *fs) {
     fs->superBlock.bpb.tot_sec = *(uint32*)(b->data + 32);
     fs->superBlock.bpb.fat_sz = *(uint32*)(b->data + 36);
     fs->superBlock.bpb.root_clus = *(uint32*)(b->data + 44);
+    uint16 infoSector = *(uint16*)(b->data + 48);
     fs->superBlock.first_data_sec = fs->superBlock.bpb.rsvd_sec_cnt + fs->superBlock.bpb.fat_cnt * fs->superBlock.bpb.fat_sz;
     fs->superBlock.data_sec_cnt = fs->superBlock.bpb.tot_sec - fs->superBlock.first_data_sec;
     fs->superBlock.data_clus_cnt = fs->superBlock.data_sec_cnt / fs->superBlock.bpb.sec_per_clus;
@@ -58,6 +72,7 @@ int fatInit(FileSystem *fs) {
     // make sure that byts_per_sec has the same value with BSIZE
     if (BSIZE != fs->superBlock.bpb.byts_per_sec)
         panic("byts_per_sec != BSIZE");
+    fatTableInit(fs, infoSector);
     memset(&fs->root, 0, sizeof(fs->root));
     initsleeplock(&fs->root.lock, "entry");
     fs->root.attribute = (ATTR_DIRECTORY | ATTR_SYSTEM);
@@ -73,6 +88,7 @@ int fatInit(FileSystem *fs) {
 
 FileSystem rootFileSystem;
 void initDirentCache() {
+    initsleeplock(&fsLock, "fileSystem");
     initLock(&direntCache.lock, "ecache");
     struct File* file = filealloc();
     rootFileSystem.image = file;
@@ -82,6 +98,7 @@ void initDirentCache() {
     file->writable = true;
    // fs->root.prev = &fs->root;
    // fs->root.next = &fs->root;
+    direntCache.lru.lru_next = direntCache.lru.lru_prev = &direntCache.lru;
     for (struct dirent* de = direntCache.entries;
          de < direntCache.entries + ENTRY_CACHE_NUM; de++) {
         de->dev = 0;
@@ -89,6 +106,12 @@ void initDirentCache() {
         de->ref = 0;
         de->dirty = 0;
         de->parent = 0;
+        de->hashed = 0;
+        de->children = 0;
+        de->lru_next = direntCache.lru.lru_next;
+        de->lru_prev = &direntCache.lru;
+        direntCache.lru.lru_next->lru_prev = de;
+        direntCache.lru.lru_next = de;
      //   de->next = fs->root.next;
      //   de->prev = &fs->root;
         initsleeplock(&de->lock, "entry");
@@ -97,18 +120,38 @@ void initDirentCache() {
     }
 }
 
+void direntCacheStat(DirentCacheStat *stat) {
+    acquireLock(&direntCache.lock);
+    *stat = direntCache.stat;
+    releaseLock(&direntCache.lock);
+}
+
 int getFsStatus(char *path, FileSystemStatus *fss) {
     struct dirent *de;
     if ((de = ename(AT_FDCWD, path)) == NULL) {
         return -1;
     }
     FileSystem *fs = de->fileSystem;
-    fss->f_bsize = 189;
+    fss->f_bsize = BSIZE;
     fss->f_blocks = fs->superBlock.bpb.tot_sec - fs->superBlock.first_data_sec;
-    fss->f_bfree = 1;
-    fss->f_bavail = 2;
+    fss->f_bfree = (u64)fatTableFreeCount(fs) * fs->superBlock.bpb.sec_per_clus;
+    fss->f_bavail = fss->f_bfree;
     fss->f_files = 4;
     fss->f_ffree = 3;
     fss->f_namelen = FAT32_MAX_FILENAME;
     return 0;
 }
+
+// Push cached FAT updates of every mounted file system into the buffer
+// cache, then write all dirty buffers to disk.
+void fsSync(void) {
+    acquiresleep(&fsLock);
+    for (int i = 0; i < FILE_SYSTEM_NUM; i++) {
+        if (fileSystem[i].valid) {
+            fatTableFlush(&fileSystem[i]);
+        }
+    }
+    releasesleep(&fsLock);
+    fatTableFlush(&rootFileSystem);
+    bsync();
+}
@@ -25,6 +25,8 @@ int pipealloc(struct File** f0, struct File** f1) {
     pi->nwrite = 0;
     pi->nread = 0;
     initLock(&pi->lock, "pipe");
+    waitQueueInit(&pi->readers, "pipe readers");
+    waitQueueInit(&pi->writers, "pipe writers");
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
     (*f0)->writable = 0;
@@ -50,10 +52,10 @@ void pipeclose(struct pipe* pi, int writable) {
     // printf("%x %x %x\n", pi->writeopen, pi->readopen, writable);
     if (writable) {
         pi->writeopen = 0;
-        wakeup(&pi->nread);
+        waitQueueWakeup(&pi->readers);
     } else {
         pi->readopen = 0;
-        wakeup(&pi->nwrite);
+        waitQueueWakeup(&pi->writers);
     }
     if (pi->readopen == 0 && pi->writeopen == 0) {
         releaseLock(&pi->lock);
@@ -75,9 +77,9 @@ int pipewrite(struct pipe* pi, u64 addr, int n) {
             return -1;
         }
         if (pi->nwrite == pi->nread + PIPESIZE) {  // DOC: pipewrite-full
-            wakeup(&pi->nread);
+            waitQueueWakeup(&pi->readers);
             // printf("Write %x Sleep? Now %x for %x, start %x, end %x, ask for %x\n", r_hartid(), i, n, pi->nread, pi->nwrite, &pi->nwrite);
-            sleep(&pi->nwrite, &pi->lock);
+            waitQueueSleep(&pi->writers, &pi->lock);
             // printf("Write %x Stop sleep\n", r_hartid());
         } else {
             // printf("%d %d\n", i, n);
@@ -88,7 +90,7 @@ int pipewrite(struct pipe* pi, u64 addr, int n) {
             i++;
         }
     }
-    wakeup(&pi->nread);
+    waitQueueWakeup(&pi->readers);
     // printf("%d %d\n", pi->nread, pi->nwrite);
     releaseLock(&pi->lock);
     return i;
@@ -107,7 +109,7 @@ int piperead(struct pipe* pi, u64 addr, int n) {
             return -1;
         }
         // printf("Read %x Sleep?\n", r_hartid());
-        sleep(&pi->nread, &pi->lock);  // DOC: piperead-sleep
+        waitQueueSleep(&pi->readers, &pi->lock);  // DOC: piperead-sleep
         // printf("Read %x Stop sleep\n", r_hartid());
     }
     for (i = 0; i < n; i++) {  // DOC: piperead-copy
@@ -121,7 +123,7 @@ int piperead(struct pipe* pi, u64 addr, int n) {
         }
     }
     // printf("%x wake up %x, start %x, end %x\n", r_hartid(), &pi->nwrite, pi->nread, pi->nwrite);
-    wakeup(&pi->nwrite);  // DOC: piperead-wakeup
+    waitQueueWakeup(&pi->writers);  // DOC: piperead-wakeup
     releaseLock(&pi->lock);
     return i;
 }
\ No newline at end of file
@@ -737,6 +737,7 @@ u64 sys_rename(void) {
     src->parent = edup(pdst);
     src->off = off;
     src->valid = 1;
+    ehash(src);
     eunlock(src);
 
     eput(psrc);
@@ -804,6 +805,7 @@ void syscallMount() {
     fs->name[1] = 0;
     fs->image = file;
     fs->read = mountBlockRead;
+    fs->prefetch = mountBlockPrefetch;
     fatInit(fs);
     fs->next = dp->head;
     dp->head = fs;
@@ -829,20 +831,18 @@ void syscallUmount() {
         return;
     }
 
-    extern DirentCache direntCache;
-    acquireLock(&direntCache.lock);
-    // bool canUmount = true;
-    for(int i = 0; i < ENTRY_CACHE_NUM; i++) {
-        struct dirent* entry = &direntCache.entries[i];
-        if (entry->fileSystem == ep->head) {
-            eput(entry);
-        }
+    // open files or a cwd under the mount still point into fs
+    FileSystem *fs = ep->head;
+    if (epurge(fs) > 0) {
+        tf->a0 = -EBUSY;
+        return;
     }
 
-    releaseLock(&direntCache.lock);
+    fatTableFree(fs);
+    bsync();
 
-    ep->head->valid = 0;
-    ep->head = ep->head->next;
+    ep->head = fs->next;
+    fsFree(fs);
 
     tf->a0 = 0;
 }
@@ -1024,3 +1024,26 @@ int getAbsolutePath(struct dirent* d, int isUser, u64 buf, int maxLen) {
     return either_copyout(isUser, buf, (void*)s, strlen(s) + 1);
 }
 
+
+void syscallSync(void) {
+    Trapframe *tf = getHartTrapFrame();
+    fsSync();
+    tf->a0 = 0;
+}
+
+void syscallFileSync(void) {
+    Trapframe *tf = getHartTrapFrame();
+    int fd = tf->a0;
+    struct File* file;
+    if (fd < 0 || fd >= NOFILE || (file = myProcess()->ofile[fd]) == NULL) {
+        tf->a0 = -EBADF;
+        return;
+    }
+    if (file->type == FD_ENTRY) {
+        elock(file->ep);
+        eupdate(file->ep);
+        eunlock(file->ep);
+    }
+    fsSync();
+    tf->a0 = 0;
+}
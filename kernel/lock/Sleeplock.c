@@ -9,6 +9,7 @@
 
 void initsleeplock(struct Sleeplock* lk, char* name) {
     initLock(&lk->lk, "sleep lock");
+    waitQueueInit(&lk->waiters, "sleep lock waiters");
     lk->name = name;
     lk->locked = 0;
     lk->tid = 0;
@@ -18,7 +19,7 @@ void acquiresleep(struct Sleeplock* lk) {
     acquireLock(&lk->lk);
     while (lk->locked) {
         // MSG_PRINT("in while");
-        sleep(lk, &lk->lk);
+        waitQueueSleep(&lk->waiters, &lk->lk);
     }
     lk->locked = 1;
     lk->tid = myThread()->id;
@@ -29,7 +30,8 @@ void releasesleep(struct Sleeplock* lk) {
     acquireLock(&lk->lk);
     lk->locked = 0;
     lk->tid = 0;
-    wakeup(lk);
+    // one waiter is enough, it takes the lock or sleeps again
+    waitQueueWakeupOne(&lk->waiters);
     releaseLock(&lk->lk);
 }
 
@@ -0,0 +1,202 @@
+#include <Asid.h>
+#include <Thread.h>
+#include <Spinlock.h>
+#include <Riscv.h>
+#include <Page.h>
+#include <Driver.h>
+
+static struct Spinlock asidLock;
+static int asidBits;  // how many ASID bits the harts implement, maybe 0
+static u64 asidGeneration = 1UL << ASID_GENERATION_SHIFT;
+static u64 asidNext = 1;
+static u64 hartGeneration[HART_TOTAL_NUMBER];
+
+// bumped when a kernel mapping changes, so other harts flush before use
+static u64 kernelMapGeneration;
+static u64 hartKernelMapGeneration[HART_TOTAL_NUMBER];
+
+// Find the ASID width by writing all ones and reading back what stuck.
+void asidInit(void) {
+    initLock(&asidLock, "asidLock");
+    u64 satp = r_satp();
+    w_satp(satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    u64 asid = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    w_satp(satp);
+    sfence_vma();
+    while (asidBits < ASID_GENERATION_SHIFT && (asid & (1UL << asidBits))) {
+        asidBits++;
+    }
+    printf("[ASID] %d bits\n", asidBits);
+}
+
+// Build the satp for running p on this hart, giving p an ASID of the
+// current generation if it has none. *flush is set when the hart must
+// flush its whole TLB once it switches to the returned satp.
+u64 asidSatp(Process *p, bool *flush) {
+    int hartId = r_hartid();
+    if (asidBits == 0) {
+        *flush = true;
+        return MAKE_SATP(p->pgdir);
+    }
+    u64 generation = asidGeneration;
+    if ((p->asid & ~ASID_MASK) != generation || hartGeneration[hartId] != generation) {
+        acquireLock(&asidLock);
+        if ((p->asid & ~ASID_MASK) != asidGeneration) {
+            if (asidNext >> asidBits) {
+                asidGeneration += 1UL << ASID_GENERATION_SHIFT;
+                asidNext = 1;
+            }
+            p->asid = asidGeneration | asidNext++;
+            p->asidHarts = p->asidStale = 0;
+        }
+        generation = asidGeneration;
+        releaseLock(&asidLock);
+    }
+    *flush = hartGeneration[hartId] != generation;
+    hartGeneration[hartId] = generation;
+
+    u64 asid = p->asid & ASID_MASK;
+    u32 self = 1U << hartId;
+    if (!*flush && (p->asidStale & self)) {
+        // p's page table changed on another hart since it last ran here
+        sfence_vma_asid(0, asid);
+    }
+    __sync_fetch_and_and(&p->asidStale, ~self);
+    __sync_fetch_and_or(&p->asidHarts, self);
+    return MAKE_SATP_ASID(p->pgdir, asid);
+}
+
+// Called after this hart flushed a kernel mapping it changed.
+static void kernelTlbChanged(void) {
+    int hartId = r_hartid();
+    u64 old = __sync_fetch_and_add(&kernelMapGeneration, 1);
+    if (hartKernelMapGeneration[hartId] == old) {
+        hartKernelMapGeneration[hartId] = old + 1;
+    }
+}
+
+// Other harts that have run p must not keep the entries for
+// [start, start + size) either. Those running p now get an IPI, the
+// rest flush p's ASID before they next run it.
+static void tlbShootdown(Process *p, u64 start, u64 size) {
+    extern Thread *currentThread[];
+    int hartId = r_hartid();
+    unsigned long running = 0;
+    u32 stale = 0;
+    for (int i = 0; i < HART_TOTAL_NUMBER; i++) {
+        if (i == hartId || !(p->asidHarts & (1U << i))) {
+            continue;
+        }
+        Thread *th = currentThread[i];
+        if (th != NULL && th->process == p) {
+            running |= 1UL << i;
+        } else {
+            stale |= 1U << i;
+        }
+    }
+    if (stale) {
+        __sync_fetch_and_or(&p->asidStale, stale);
+    }
+    if (running) {
+        sbi_remote_sfence_vma_asid(&running, start, size, p->asid & ASID_MASK);
+    }
+}
+
+static inline bool asidLive(Process *p, u64 *pgdir) {
+    return p != NULL && p->pgdir == pgdir && asidBits > 0 && p->asid != 0;
+}
+
+// Flush the TLB entry for va after its PTE in pgdir changed, or leave
+// it to the open gather. A user page table without a live ASID is being
+// built or torn down, so flushing va in every address space is enough.
+void tlbFlushPage(u64 *pgdir, u64 va) {
+    extern u64 kernelPageDirectory[];
+    Thread *th = myThread();
+    TlbGather *gather = th ? th->tlbGather : NULL;
+    if (gather != NULL && pgdir != kernelPageDirectory) {
+        if (gather->pgdir != pgdir) {
+            gather->foreign = true;
+            return;
+        }
+        va = DOWN_ALIGN(va, PAGE_SIZE);
+        if (gather->pages == 0 || va < gather->start) {
+            gather->start = va;
+        }
+        if (gather->pages == 0 || va + PAGE_SIZE > gather->end) {
+            gather->end = va + PAGE_SIZE;
+        }
+        gather->pages++;
+        return;
+    }
+
+    Process *p = th ? th->process : NULL;
+    if (asidLive(p, pgdir)) {
+        sfence_vma_asid(va, p->asid & ASID_MASK);
+        tlbShootdown(p, DOWN_ALIGN(va, PAGE_SIZE), PAGE_SIZE);
+        return;
+    }
+    sfence_vma_va(va);
+    if (pgdir == kernelPageDirectory) {
+        kernelTlbChanged();
+    }
+}
+
+void tlbGatherBegin(TlbGather *gather, u64 *pgdir) {
+    Thread *th = myThread();
+    gather->pgdir = pgdir;
+    gather->start = gather->end = 0;
+    gather->pages = 0;
+    gather->foreign = false;
+    gather->prev = th ? th->tlbGather : NULL;
+    if (th) {
+        th->tlbGather = gather;
+    }
+}
+
+void tlbGatherEnd(TlbGather *gather) {
+    Thread *th = myThread();
+    if (th) {
+        th->tlbGather = gather->prev;
+    }
+    Process *p = th ? th->process : NULL;
+    bool whole = gather->end - gather->start > TLB_GATHER_MAX_PAGES * PAGE_SIZE;
+
+    if (gather->foreign) {
+        sfence_vma();
+    }
+    if (gather->pages == 0) {
+        return;
+    }
+    if (!asidLive(p, gather->pgdir)) {
+        if (whole && !gather->foreign) {
+            sfence_vma();
+        } else if (!gather->foreign) {
+            for (u64 va = gather->start; va < gather->end; va += PAGE_SIZE) {
+                sfence_vma_va(va);
+            }
+        }
+        return;
+    }
+
+    u64 asid = p->asid & ASID_MASK;
+    if (whole) {
+        sfence_vma_asid(0, asid);
+        tlbShootdown(p, 0, (u64)-1);
+        return;
+    }
+    for (u64 va = gather->start; va < gather->end; va += PAGE_SIZE) {
+        sfence_vma_asid(va, asid);
+    }
+    tlbShootdown(p, gather->start, gather->end - gather->start);
+}
+
+// User entries are tagged and the kernel's are not flushed on every
+// trap any more, so catch up with kernel mappings changed elsewhere.
+void kernelTlbSync(void) {
+    int hartId = r_hartid();
+    u64 generation = kernelMapGeneration;
+    if (hartKernelMapGeneration[hartId] != generation) {
+        hartKernelMapGeneration[hartId] = generation;
+        sfence_vma();
+    }
+}
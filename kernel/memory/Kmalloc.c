@@ -0,0 +1,177 @@
+#include <Kmalloc.h>
+#include <Page.h>
+#include <Queue.h>
+#include <Spinlock.h>
+#include <Interrupt.h>
+#include <Riscv.h>
+#include <Driver.h>
+#include <string.h>
+
+// Header at the start of every slab page, the objects follow it.
+typedef struct Slab {
+    LIST_ENTRY(Slab) link;  // on the partial list of its class
+    void *free;             // free objects, linked through their first word
+    u16 inuse;
+    u8 sizeClass;
+} Slab;
+
+LIST_HEAD(SlabList, Slab);
+
+#define SLAB_OBJECT_BASE 32
+
+static struct KmallocClass {
+    struct Spinlock lock;
+    struct SlabList partial;  // slabs with free objects
+} kmallocClass[KMALLOC_CLASS_NUM];
+
+// only touched by their hart, with interrupts off
+static struct KmallocCache {
+    void *objects[KMALLOC_CACHE_SIZE];
+    int count;
+} kmallocCache[HART_TOTAL_NUMBER][KMALLOC_CLASS_NUM];
+
+static inline u64 classSize(int c) {
+    return 1UL << (KMALLOC_MIN_SHIFT + c);
+}
+
+static inline int sizeClass(u64 size) {
+    int c = 0;
+    while (classSize(c) < size) {
+        c++;
+    }
+    return c;
+}
+
+void kmallocInit(void) {
+    assert(sizeof(Slab) <= SLAB_OBJECT_BASE);
+    for (int i = 0; i < KMALLOC_CLASS_NUM; i++) {
+        initLock(&kmallocClass[i].lock, "kmalloc");
+        LIST_INIT(&kmallocClass[i].partial);
+    }
+}
+
+// caller holds the class lock
+static Slab *slabCreate(int c) {
+    PhysicalPage *page;
+    if (pageAllocFlags(&page, 0) < 0) {
+        return NULL;
+    }
+    page->flags = PAGE_SLAB;
+    Slab *slab = (Slab *)page2pa(page);
+    slab->free = NULL;
+    slab->inuse = 0;
+    slab->sizeClass = c;
+    u64 size = classSize(c);
+    for (u64 off = PAGE_SIZE - size; off >= SLAB_OBJECT_BASE; off -= size) {
+        void **object = (void **)((u64)slab + off);
+        *object = slab->free;
+        slab->free = object;
+    }
+    LIST_INSERT_HEAD(&kmallocClass[c].partial, slab, link);
+    return slab;
+}
+
+// Give an object back to its slab, releasing the slab once it is empty
+// unless it is the only one left with free objects.
+// caller holds the class lock
+static void slabPut(void *object) {
+    Slab *slab = (Slab *)DOWN_ALIGN(object, PAGE_SIZE);
+    struct KmallocClass *kc = &kmallocClass[slab->sizeClass];
+    if (slab->free == NULL) {
+        LIST_INSERT_HEAD(&kc->partial, slab, link);
+    }
+    *(void **)object = slab->free;
+    slab->free = object;
+    if (--slab->inuse == 0 &&
+        (LIST_FIRST(&kc->partial) != slab || LIST_NEXT(slab, link) != NULL)) {
+        LIST_REMOVE(slab, link);
+        PhysicalPage *page = pa2page((u64)slab);
+        page->flags = 0;
+        pageFree(page);
+    }
+}
+
+static void cacheRefill(int c, struct KmallocCache *cache) {
+    struct KmallocClass *kc = &kmallocClass[c];
+    acquireLock(&kc->lock);
+    while (cache->count < KMALLOC_CACHE_BATCH) {
+        Slab *slab = LIST_FIRST(&kc->partial);
+        if (slab == NULL && (slab = slabCreate(c)) == NULL) {
+            break;
+        }
+        void *object = slab->free;
+        slab->free = *(void **)object;
+        slab->inuse++;
+        if (slab->free == NULL) {
+            LIST_REMOVE(slab, link);
+        }
+        cache->objects[cache->count++] = object;
+    }
+    releaseLock(&kc->lock);
+}
+
+static void *largeAlloc(u64 size) {
+    int order = 0;
+    while ((PAGE_SIZE << order) < size) {
+        order++;
+    }
+    PhysicalPage *page;
+    if (pageAllocOrder(&page, order) < 0) {
+        return NULL;
+    }
+    page->flags = PAGE_KMALLOC;
+    page->order = order;
+    return (void *)page2pa(page);
+}
+
+void *kmalloc(u64 size, int flags) {
+    void *object = NULL;
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > KMALLOC_MAX_SIZE) {
+        // whole pages come zeroed from pageAllocOrder
+        return largeAlloc(size);
+    }
+    int c = sizeClass(size);
+    interruptPush();
+    struct KmallocCache *cache = &kmallocCache[r_hartid()][c];
+    if (cache->count == 0) {
+        cacheRefill(c, cache);
+    }
+    if (cache->count > 0) {
+        object = cache->objects[--cache->count];
+    }
+    interruptPop();
+    if (object && (flags & KMALLOC_ZERO)) {
+        memset(object, 0, classSize(c));
+    }
+    return object;
+}
+
+void kfree(void *object) {
+    if (object == NULL) {
+        return;
+    }
+    PhysicalPage *page = pa2page(DOWN_ALIGN(object, PAGE_SIZE));
+    if (page->flags == PAGE_KMALLOC) {
+        page->flags = 0;
+        pageFreeOrder(page, page->order);
+        return;
+    }
+    if (page->flags != PAGE_SLAB) {
+        panic("kfree: %lx is not from kmalloc", (u64)object);
+    }
+    int c = ((Slab *)DOWN_ALIGN(object, PAGE_SIZE))->sizeClass;
+    interruptPush();
+    struct KmallocCache *cache = &kmallocCache[r_hartid()][c];
+    if (cache->count == KMALLOC_CACHE_SIZE) {
+        acquireLock(&kmallocClass[c].lock);
+        while (cache->count > KMALLOC_CACHE_SIZE - KMALLOC_CACHE_BATCH) {
+            slabPut(cache->objects[--cache->count]);
+        }
+        releaseLock(&kmallocClass[c].lock);
+    }
+    cache->objects[cache->count++] = object;
+    interruptPop();
+}
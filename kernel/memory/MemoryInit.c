@@ -5,8 +5,9 @@
 #include <Platform.h>
 #include <Process.h>
 #include "Spinlock.h"
+#include <Asid.h>
+#include <Kmalloc.h>
 
-PageList freePages;
 PhysicalPage pages[PHYSICAL_PAGE_NUM];
 extern char kernelStart[];
 extern char kernelEnd[];
@@ -20,11 +21,7 @@ static void initFreePages() {
     }
 
     n = PA2PPN(PHYSICAL_MEMORY_TOP);
-    LIST_INIT(&freePages);
-    for (; i < n; i++) {
-        pages[i].ref = 0;
-        LIST_INSERT_HEAD(&freePages, &pages[i], link);
-    }
+    pageFreeInit(i, n);
 }
 
 static void resetRef() {
@@ -34,6 +31,21 @@ static void resetRef() {
     }
 }
 
+// Map [va, va + size) to pa with the largest pages that alignment allows.
+static void mapRange(u64 va, u64 pa, u64 size, u64 perm) {
+    u64 end = va + size;
+    while (va < end) {
+        int level = 2;
+        while (level > 0 && ((va | pa) & (PAGE_LEVEL_SIZE(level) - 1) ||
+                             va + PAGE_LEVEL_SIZE(level) > end)) {
+            level--;
+        }
+        pageInsertLevel(kernelPageDirectory, va, pa, perm, level);
+        va += PAGE_LEVEL_SIZE(level);
+        pa += PAGE_LEVEL_SIZE(level);
+    }
+}
+
 static void virtualMemory() {
     u64 va, pa;
     pageInsert(kernelPageDirectory, UART_V, UART, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
@@ -46,20 +58,17 @@ static void virtualMemory() {
         pageInsert(kernelPageDirectory, va + i, pa + i, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     }
     va = PLIC_V + 0x200000; pa = PLIC + 0x200000;
-    for (u64 i = 0; i < 0x4000; i += PAGE_SIZE) {
+    for (u64 i = 0; i < 0x2000 * HART_TOTAL_NUMBER; i += PAGE_SIZE) {
         pageInsert(kernelPageDirectory, va + i, pa + i, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     }
+    pageInsert(kernelPageDirectory, VIRTIO0_V, VIRTIO0, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     pageInsert(kernelPageDirectory, SPI_CTRL_ADDR, SPI_CTRL_ADDR, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     pageInsert(kernelPageDirectory, UART_CTRL_ADDR, UART_CTRL_ADDR, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     extern char textEnd[];
     va = pa = (u64)kernelStart;
-    for (u64 i = 0; va + i < (u64)textEnd; i += PAGE_SIZE) {
-        pageInsert(kernelPageDirectory, va + i, pa + i, PTE_READ | PTE_EXECUTE | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
-    }
+    mapRange(va, pa, (u64)textEnd - va, PTE_READ | PTE_EXECUTE | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     va = pa = (u64)textEnd;
-    for (u64 i = 0; va + i < PHYSICAL_MEMORY_TOP; i += PAGE_SIZE) {
-        pageInsert(kernelPageDirectory, va + i, pa + i, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
-    }
+    mapRange(va, pa, PHYSICAL_MEMORY_TOP - va, PTE_READ | PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
     extern char trampoline[];
     pageInsert(kernelPageDirectory, TRAMPOLINE_BASE, (u64)trampoline, 
         PTE_READ | PTE_WRITE | PTE_EXECUTE | PTE_ACCESSED | PTE_DIRTY);
@@ -93,6 +102,8 @@ void memoryInit() {
     virtualMemory();
     resetRef();
     startPage();
+    asidInit();
+    kmallocInit();
     printf("Memory init finish!\n");
     printf("Test memory start...\n");
     testMemory();
@@ -7,67 +7,285 @@
 #include <Process.h>
 #include <Sysarg.h>
 #include <MemoryConfig.h>
+#include <Interrupt.h>
+#include <Asid.h>
 
 
-extern PageList freePages;
-struct Spinlock pageListLock, cowBufferLock;
+struct Spinlock pageListLock;
+
+// buddy lists, protected by pageListLock
+static struct {
+    PageList free[PAGE_MAX_ORDER];
+    u32 count[PAGE_MAX_ORDER];
+} buddy;
+
+// hot single pages of each hart, only touched by that hart
+static struct PageCache {
+    PhysicalPage *pages[PAGE_CACHE_SIZE];
+    int count;
+} pageCache[HART_TOTAL_NUMBER];
+
+static int freePageCount;
+
+// pages zeroed ahead of time by idle harts, still counted as free
+static struct {
+    struct Spinlock lock;
+    PhysicalPage *pages[PAGE_ZERO_POOL];
+    int count;
+} zeroPool;
+
+static HugePageStat hugeStat;
+
+static int pageWalk(u64 *pgdir, u64 va, int target, bool create, u64 **pte, int *leaf);
 
 inline void pageLockInit(void) {
     initLock(&pageListLock, "pageListLock");
-    initLock(&cowBufferLock, "cowBufferLock");
+    initLock(&zeroPool.lock, "zeroPool");
 }
 
 int pageRemove(u64 *pgdir, u64 va) {
     u64 *pte;
-    u64 pa = pageLookup(pgdir, va, &pte);
+    int leaf;
+    pageWalk(pgdir, va, 0, false, &pte, &leaf);
 
-    if (!pte) {
+    if (!pte || !(*pte & PTE_VALID)) {
         return -1;
     }
+    u64 pa = PTE2PA(*pte);
     // tlb flush
     if (pa < PHYSICAL_ADDRESS_BASE || pa >= PHYSICAL_MEMORY_TOP) {
         return -1;
     }
-    PhysicalPage *page = pa2page(pa);
-    page->ref--;
-    pageFree(page);
+    for (u64 i = 0; i < PAGE_LEVEL_SIZE(leaf) && pa + i < PHYSICAL_MEMORY_TOP; i += PAGE_SIZE) {
+        PhysicalPage *page = pa2page(pa + i);
+        page->ref--;
+        pageFree(page);
+    }
     *pte = 0;
-    sfence_vma();
+    tlbFlushPage(pgdir, va);
     return 0;
 }
 
 int countFreePages() {
-    struct PhysicalPage* page;
-    int count = 0;
+    return freePageCount + zeroPool.count;
+}
+
+static PhysicalPage *zeroPoolTake(void) {
+    PhysicalPage *page = NULL;
+    if (zeroPool.count == 0) {
+        return NULL;
+    }
+    acquireLock(&zeroPool.lock);
+    if (zeroPool.count > 0) {
+        page = zeroPool.pages[--zeroPool.count];
+    }
+    releaseLock(&zeroPool.lock);
+    return page;
+}
+
+// Take a block of 2^order pages, splitting a larger one if needed.
+// caller must hold pageListLock
+static PhysicalPage *buddyAlloc(int order) {
+    int o = order;
+    while (o < PAGE_MAX_ORDER && LIST_EMPTY(&buddy.free[o])) {
+        o++;
+    }
+    if (o == PAGE_MAX_ORDER) {
+        return NULL;
+    }
+    PhysicalPage *page = LIST_FIRST(&buddy.free[o]);
+    LIST_REMOVE(page, link);
+    buddy.count[o]--;
+    page->flags = 0;
+    while (o > order) {
+        o--;
+        PhysicalPage *half = page + (1 << o);
+        half->order = o;
+        half->flags = PAGE_FREE;
+        LIST_INSERT_HEAD(&buddy.free[o], half, link);
+        buddy.count[o]++;
+    }
+    return page;
+}
+
+// Give back a block of 2^order pages, merging it with its free buddies.
+// caller must hold pageListLock
+static void buddyFree(PhysicalPage *page, int order) {
+    u32 ppn = page2PPN(page);
+    while (order < PAGE_MAX_ORDER - 1) {
+        u32 buddyPPN = ppn ^ (1 << order);
+        if (buddyPPN >= PHYSICAL_PAGE_NUM) {
+            break;
+        }
+        PhysicalPage *b = ppn2page(buddyPPN);
+        if (b->flags != PAGE_FREE || b->order != order) {
+            break;
+        }
+        LIST_REMOVE(b, link);
+        buddy.count[order]--;
+        b->flags = 0;
+        ppn &= ~(1 << order);
+        order++;
+    }
+    page = ppn2page(ppn);
+    page->order = order;
+    page->flags = PAGE_FREE;
+    LIST_INSERT_HEAD(&buddy.free[order], page, link);
+    buddy.count[order]++;
+}
+
+// Hand the pages [startPPN, endPPN) to the allocator in the largest
+// aligned blocks that fit.
+void pageFreeInit(u32 startPPN, u32 endPPN) {
     acquireLock(&pageListLock);
-    LIST_FOREACH(page, &freePages, link)
-        count++;
+    for (int i = 0; i < PAGE_MAX_ORDER; i++) {
+        LIST_INIT(&buddy.free[i]);
+    }
+    u32 ppn = startPPN;
+    while (ppn < endPPN) {
+        int order = PAGE_MAX_ORDER - 1;
+        while ((ppn & ((1 << order) - 1)) || ppn + (1 << order) > endPPN) {
+            order--;
+        }
+        for (u32 i = 0; i < (1 << order); i++) {
+            ppn2page(ppn + i)->ref = 0;
+        }
+        buddyFree(ppn2page(ppn), order);
+        freePageCount += 1 << order;
+        ppn += 1 << order;
+    }
     releaseLock(&pageListLock);
-    return count;
 }
 
-int pageAlloc(PhysicalPage **pp) {
-    acquireLock(&pageListLock);
-    PhysicalPage *page;
-    if ((page = LIST_FIRST(&freePages)) != NULL) {
-        *pp = page;
-        page->hartId = r_hartid();
-        LIST_REMOVE(page, link);
+static PhysicalPage *pageCacheTake(void) {
+    PhysicalPage *page = NULL;
+    interruptPush();
+    struct PageCache *cache = &pageCache[r_hartid()];
+    if (cache->count == 0) {
+        acquireLock(&pageListLock);
+        while (cache->count < PAGE_CACHE_BATCH) {
+            PhysicalPage *p = buddyAlloc(0);
+            if (p == NULL) {
+                break;
+            }
+            p->flags = PAGE_CACHED;
+            cache->pages[cache->count++] = p;
+        }
         releaseLock(&pageListLock);
+    }
+    if (cache->count > 0) {
+        page = cache->pages[--cache->count];
+        page->flags = 0;
+        __sync_fetch_and_sub(&freePageCount, 1);
+    }
+    interruptPop();
+    return page;
+}
+
+// Allocate a page. Its contents are garbage unless flags has
+// PAGE_ALLOC_ZERO, so leave that out only when every byte is about to
+// be overwritten.
+int pageAllocFlags(PhysicalPage **pp, int flags) {
+    PhysicalPage *page = NULL;
+    bool zeroed = false;
+    if (flags & PAGE_ALLOC_ZERO) {
+        zeroed = (page = zeroPoolTake()) != NULL;
+    }
+    if (page == NULL) {
+        page = pageCacheTake();
+    }
+    if (page == NULL) {
+        zeroed = (page = zeroPoolTake()) != NULL;
+    }
+    if (page == NULL) {
+        printf("there's no physical page left!\n");
+        *pp = NULL;
+        return -NO_FREE_MEMORY;
+    }
+    page->hartId = r_hartid();
+    *pp = page;
+    if ((flags & PAGE_ALLOC_ZERO) && !zeroed) {
         bzero((void*)page2pa(page), PAGE_SIZE);
-        return 0;
     }
+    return 0;
+}
+
+int pageAlloc(PhysicalPage **pp) {
+    return pageAllocFlags(pp, PAGE_ALLOC_ZERO);
+}
+
+// Zero one free page for the pool. Called by harts with nothing to run,
+// which wait for an interrupt once this returns false.
+bool pageZeroIdle(void) {
+    if (zeroPool.count >= PAGE_ZERO_POOL || freePageCount <= PAGE_ZERO_POOL) {
+        return false;
+    }
+    PhysicalPage *page = pageCacheTake();
+    if (page == NULL) {
+        return false;
+    }
+    bzero((void*)page2pa(page), PAGE_SIZE);
+    acquireLock(&zeroPool.lock);
+    if (zeroPool.count < PAGE_ZERO_POOL) {
+        zeroPool.pages[zeroPool.count++] = page;
+        page = NULL;
+    }
+    releaseLock(&zeroPool.lock);
+    if (page) {
+        pageFree(page);
+    }
+    return true;
+}
+
+// Allocate 2^order physically contiguous pages, *pp is the first one.
+int pageAllocOrder(PhysicalPage **pp, int order) {
+    if (order == 0) {
+        return pageAlloc(pp);
+    }
+    if (order < 0 || order >= PAGE_MAX_ORDER) {
+        *pp = NULL;
+        return -NO_FREE_MEMORY;
+    }
+    acquireLock(&pageListLock);
+    PhysicalPage *page = buddyAlloc(order);
+    releaseLock(&pageListLock);
+    if (page == NULL) {
+        *pp = NULL;
+        return -NO_FREE_MEMORY;
+    }
+    __sync_fetch_and_sub(&freePageCount, 1 << order);
+    page->hartId = r_hartid();
+    *pp = page;
+    bzero((void*)page2pa(page), PAGE_SIZE << order);
+    return 0;
+}
+
+void pageFreeOrder(PhysicalPage *page, int order) {
+    if (order == 0) {
+        pageFree(page);
+        return;
+    }
+    acquireLock(&pageListLock);
+    buddyFree(page, order);
     releaseLock(&pageListLock);
-    printf("there's no physical page left!\n");
-    *pp = NULL;
-    return -NO_FREE_MEMORY;
+    __sync_fetch_and_add(&freePageCount, 1 << order);
 }
 
-static int pageWalk(u64 *pgdir, u64 va, bool create, u64 **pte) {
+// Find the PTE mapping va at the given level, 0 for a 4 KiB page, 1 for
+// 2 MiB and 2 for 1 GiB. The walk stops early at a larger leaf that
+// already covers va. *leaf, if given, is the level of the PTE returned.
+static int pageWalk(u64 *pgdir, u64 va, int target, bool create, u64 **pte, int *leaf) {
     int level;
     u64 *addr = pgdir;
-    for (level = 2; level > 0; level--) {
+    for (level = 2; level > target; level--) {
         addr += GET_PAGE_TABLE_INDEX(va, level);
+        if (PTE_IS_LEAF(*addr)) {
+            *pte = addr;
+            if (leaf) {
+                *leaf = level;
+            }
+            return 0;
+        }
         if (!(*addr) & PTE_VALID) {
             if (!create) {
                 *pte = NULL;
@@ -83,48 +301,137 @@ static int pageWalk(u64 *pgdir, u64 va, bool create, u64 **pte) {
         }
         addr = (u64*)PTE2PA(*addr);
     }
-    *pte = addr + GET_PAGE_TABLE_INDEX(va, 0);
+    *pte = addr + GET_PAGE_TABLE_INDEX(va, target);
+    if (leaf) {
+        *leaf = target;
+    }
     return 0;
 }
 
+// Returns the physical address of the 4 KiB page holding va, even if a
+// megapage maps it; *pte is the leaf PTE.
 u64 pageLookup(u64 *pgdir, u64 va, u64 **pte) {
     u64 *entry;
-    pageWalk(pgdir, va, false, &entry);
+    int leaf;
+    pageWalk(pgdir, va, 0, false, &entry, &leaf);
     if (entry == NULL || !(*entry & PTE_VALID)) {
         return 0;
     }
     if (pte) {
         *pte = entry;
     }
-    return PTE2PA(*entry);
+    return PTE2PA(*entry) + DOWN_ALIGN(va & (PAGE_LEVEL_SIZE(leaf) - 1), PAGE_SIZE);
+}
+
+// Turn the megapage leaf *pte into a table of 4 KiB leaves with the
+// same permissions. The pages keep the references the megapage held.
+static int splitLeaf(u64 *pgdir, u64 va, u64 *pte) {
+    PhysicalPage *table;
+    int ret = pageAllocFlags(&table, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    table->ref++;
+    u64 *entries = (u64*)page2pa(table);
+    u64 pa = PTE2PA(*pte);
+    for (int i = 0; i < PTE2PT; i++) {
+        entries[i] = PA2PTE(pa + i * PAGE_SIZE) | PTE2PERM(*pte);
+    }
+    *pte = page2pte(table) | PTE_VALID;
+    tlbFlushPage(pgdir, va);
+    __sync_fetch_and_add(&hugeStat.splits, 1);
+    return 0;
+}
+
+// Split the user megapage mapping va, if there is one.
+int pageSplit(u64 *pgdir, u64 va) {
+    u64 *pte;
+    int leaf;
+    pageWalk(pgdir, va, 0, false, &pte, &leaf);
+    if (pte == NULL || leaf != 1 || !(*pte & PTE_USER)) {
+        return 0;
+    }
+    return splitLeaf(pgdir, va, pte);
+}
+
+// Size of the page mapping va, 0 if it is not mapped.
+u64 pageMappingSize(u64 *pgdir, u64 va) {
+    u64 *pte;
+    int leaf;
+    pageWalk(pgdir, va, 0, false, &pte, &leaf);
+    if (pte == NULL || !(*pte & PTE_VALID)) {
+        return 0;
+    }
+    return PAGE_LEVEL_SIZE(leaf);
+}
+
+// Map a zeroed 2 MiB page at va if nothing in that range is mapped yet.
+// Returns -1 when the caller should fall back to 4 KiB pages.
+int pageInsertHuge(u64 *pgdir, u64 va, u64 perm) {
+#ifdef TRANSPARENT_HUGE_PAGE
+    u64 *pte;
+    if (va & (MEGA_PAGE_SIZE - 1)) {
+        return -1;
+    }
+    pageWalk(pgdir, va, 1, false, &pte, NULL);
+    if (pte != NULL && *pte) {
+        return -1;
+    }
+    PhysicalPage *page;
+    if (pageAllocOrder(&page, HUGE_PAGE_ORDER) < 0) {
+        __sync_fetch_and_add(&hugeStat.fallbacks, 1);
+        return -1;
+    }
+    if (pageInsertLevel(pgdir, va, page2pa(page), perm, 1) < 0) {
+        pageFreeOrder(page, HUGE_PAGE_ORDER);
+        return -1;
+    }
+    __sync_fetch_and_add(&hugeStat.mapped, 1);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void hugePageStat(HugePageStat *stat) {
+    *stat = hugeStat;
 }
 
 void pageFree(PhysicalPage *page) {
-    if (page->ref > 0) {
+    // still referenced, or already free
+    if (page->ref > 0 || page->flags) {
         return;
     }
-    if (page->ref == 0) {
+    page->flags = PAGE_CACHED;
+    __sync_fetch_and_add(&freePageCount, 1);
+    interruptPush();
+    struct PageCache *cache = &pageCache[r_hartid()];
+    if (cache->count == PAGE_CACHE_SIZE) {
         acquireLock(&pageListLock);
-        LIST_INSERT_HEAD(&freePages, page, link);
+        while (cache->count > PAGE_CACHE_SIZE - PAGE_CACHE_BATCH) {
+            PhysicalPage *p = cache->pages[--cache->count];
+            p->flags = 0;
+            buddyFree(p, 0);
+        }
         releaseLock(&pageListLock);
     }
+    cache->pages[cache->count++] = page;
+    interruptPop();
 }
 
 static void paDecreaseRef(u64 pa) {
     PhysicalPage *page = pa2page(pa);
     page->ref--;
     assert(page->ref==0);
-    if (page->ref == 0) {
-        acquireLock(&pageListLock);
-        LIST_INSERT_HEAD(&freePages, page, link);
-        releaseLock(&pageListLock);
-    }
+    pageFree(page);
 }
 
 void pgdirFree(u64* pgdir) {
     // printf("jaoeifherigh   %lx\n", (u64)pgdir);
     u64 i, j, k;
     u64* pageTable;
+    TlbGather gather;
+    tlbGatherBegin(&gather, pgdir);
     for (i = 0; i < PTE2PT; i++) {
         if (!(pgdir[i] & PTE_VALID))
             continue;
@@ -133,6 +440,10 @@ void pgdirFree(u64* pgdir) {
         for (j = 0; j < PTE2PT; j++) {
             if (!(pa[j] & PTE_VALID)) 
                 continue;
+            if (PTE_IS_LEAF(pa[j])) {
+                pageRemove(pgdir, (i << 30) | (j << 21));
+                continue;
+            }
             pageTable = (u64*) pa + j;
             u64* pa2 = (u64*) PTE2PA(*pageTable);
             for (k = 0; k < PTE2PT; k++) {
@@ -146,29 +457,124 @@ void pgdirFree(u64* pgdir) {
         }
         paDecreaseRef((u64) pa);
     }
+    tlbGatherEnd(&gather);
     paDecreaseRef((u64) pgdir);
 }
 
+// The page table *pte points to, allocated if the entry is empty.
+static int tableGet(u64 *pte, u64 **table) {
+    if (!(*pte & PTE_VALID)) {
+        PhysicalPage *pp;
+        int ret = pageAlloc(&pp);
+        if (ret < 0) {
+            return ret;
+        }
+        pp->ref++;
+        *pte = page2pte(pp) | PTE_VALID;
+    }
+    *table = (u64*)PTE2PA(*pte);
+    return 0;
+}
+
+// Share the leaf *src of the parent with the child entry *dst,
+// write protecting it in both.
+static void forkLeaf(u64 *pgdir, u64 va, u64 *src, u64 *dst, int level) {
+    if (*src & PTE_WRITE) {
+        *src = (*src | PTE_COW) & ~PTE_WRITE;
+        tlbFlushPage(pgdir, va);
+    }
+    *dst = *src;
+    u64 pa = PTE2PA(*src);
+    for (u64 i = 0; i < PAGE_LEVEL_SIZE(level); i += PAGE_SIZE) {
+        if (IS_RAM(pa + i)) {
+            pa2page(pa + i)->ref++;
+        }
+    }
+}
+
+// Copy the user mappings of parent into child for fork, filling the
+// child's tables directly instead of walking them for every page.
+// Writable pages become copy-on-write in both. Entries the child
+// already has, such as its trampolines, are kept.
+int pgdirFork(u64 *child, u64 *parent) {
+    TlbGather gather;
+    int ret = 0;
+    tlbGatherBegin(&gather, parent);
+    for (u64 i = 0; i < PTE2PT && ret == 0; i++) {
+        if (!(parent[i] & PTE_VALID) || PTE_IS_LEAF(parent[i])) {
+            continue;
+        }
+        u64 *src1 = (u64*)PTE2PA(parent[i]), *dst1;
+        if ((ret = tableGet(child + i, &dst1)) < 0) {
+            break;
+        }
+        for (u64 j = 0; j < PTE2PT; j++) {
+            if (!(src1[j] & PTE_VALID)) {
+                continue;
+            }
+            u64 va = (i << 30) | (j << 21);
+            if (PTE_IS_LEAF(src1[j])) {
+                if (!(dst1[j] & PTE_VALID)) {
+                    forkLeaf(parent, va, src1 + j, dst1 + j, 1);
+                }
+                continue;
+            }
+            u64 *src0 = (u64*)PTE2PA(src1[j]), *dst0;
+            if ((ret = tableGet(dst1 + j, &dst0)) < 0) {
+                break;
+            }
+            for (u64 k = 0; k < PTE2PT; k++) {
+                if ((src0[k] & PTE_VALID) && !(dst0[k] & PTE_VALID)) {
+                    forkLeaf(parent, va | (k << 12), src0 + k, dst0 + k, 0);
+                }
+            }
+        }
+    }
+    tlbGatherEnd(&gather);
+    return ret;
+}
+
 int pageInsert(u64 *pgdir, u64 va, u64 pa, u64 perm) {
+    return pageInsertLevel(pgdir, va, pa, perm, 0);
+}
+
+// Map a page of PAGE_LEVEL_SIZE(level) bytes, replacing a mapping of the
+// same size. A user megapage around va is split first; otherwise fails
+// if va lies in a larger page or, for a megapage, if a page table
+// already covers it.
+int pageInsertLevel(u64 *pgdir, u64 va, u64 pa, u64 perm, int level) {
     u64 *pte;
-    va = DOWN_ALIGN(va, PAGE_SIZE);
-    pa = DOWN_ALIGN(pa, PAGE_SIZE);
+    int leaf;
+    u64 size = PAGE_LEVEL_SIZE(level);
+    va = DOWN_ALIGN(va, size);
+    pa = DOWN_ALIGN(pa, size);
     perm |= PTE_ACCESSED | PTE_DIRTY;
-    int ret = pageWalk(pgdir, va, false, &pte);
+    int ret = pageWalk(pgdir, va, level, false, &pte, &leaf);
     if (ret < 0) {
         return ret;
     }
+    if (pte != NULL && leaf == 1 && level == 0 && (*pte & PTE_USER)) {
+        if ((ret = splitLeaf(pgdir, va, pte)) < 0) {
+            return ret;
+        }
+        pageWalk(pgdir, va, level, false, &pte, &leaf);
+    }
     if (pte != NULL && (*pte & PTE_VALID)) {
+        if (leaf != level || !PTE_IS_LEAF(*pte)) {
+            return -INVALID_PARAM;
+        }
         pageRemove(pgdir, va);
     }
-    ret = pageWalk(pgdir, va, true, &pte);
+    ret = pageWalk(pgdir, va, level, true, &pte, &leaf);
     if (ret < 0) {
         return ret;
     }
     *pte = PA2PTE(pa) | perm | PTE_VALID;
-    if (pa >= PHYSICAL_ADDRESS_BASE && pa < PHYSICAL_MEMORY_TOP)
-        pa2page(pa)->ref++;
-    sfence_vma();
+    for (u64 i = 0; i < size; i += PAGE_SIZE) {
+        if (pa + i >= PHYSICAL_ADDRESS_BASE && pa + i < PHYSICAL_MEMORY_TOP)
+            pa2page(pa + i)->ref++;
+    }
+    tlbFlushPage(pgdir, va);
     return 0;
 }
 
@@ -186,6 +592,11 @@ void pageout(u64 *pgdir, u64 badAddr) {
         panic("^^^^^^^^^^TOO LOW^^^^^^^^^^^\n");
     }
     // printf("[Page out]pageout at %lx\n", badAddr);
+    u64 huge = DOWN_ALIGN(badAddr, MEGA_PAGE_SIZE);
+    if (huge >= USER_HEAP_BOTTOM && huge + MEGA_PAGE_SIZE <= myProcess()->heapBottom &&
+        pageInsertHuge(pgdir, huge, PTE_USER | PTE_READ | PTE_WRITE) == 0) {
+        return;
+    }
     PhysicalPage *page;
     if (pageAlloc(&page) < 0) {
         panic("");
@@ -196,7 +607,10 @@ void pageout(u64 *pgdir, u64 badAddr) {
     }
 }
 
-u8 cowBuffer[PAGE_SIZE];
+// Resolve a write to a copy-on-write page. The last sharer of a 4 KiB
+// page just gets it back writable; otherwise the old frame is copied
+// straight into a new one before the mapping, and with it our
+// reference to the old frame, is replaced.
 void cowHandler(u64 *pgdir, u64 badAddr) {
     u64 pa;
     u64 *pte;
@@ -206,18 +620,20 @@ void cowHandler(u64 *pgdir, u64 badAddr) {
         printf("access denied");
         return;
     }
+    u64 perm = (PTE2PERM(*pte) | PTE_WRITE) & ~PTE_COW;
+    if (pa2page(pa)->ref == 1 && pageMappingSize(pgdir, badAddr) == PAGE_SIZE) {
+        *pte = PA2PTE(pa) | perm;
+        tlbFlushPage(pgdir, badAddr);
+        return;
+    }
     PhysicalPage *page;
-    int r = pageAlloc(&page);
+    int r = pageAllocFlags(&page, 0);
     if (r < 0) {
         panic("cow handler error");
         return;
     }
-    acquireLock(&cowBufferLock);
-    pa = pageLookup(pgdir, badAddr, &pte);
-    bcopy((void *)pa, (void*)cowBuffer, PAGE_SIZE);
-    pageInsert(pgdir, badAddr, page2pa(page), (PTE2PERM(*pte) | PTE_WRITE) & ~PTE_COW);
-    bcopy((void*) cowBuffer, (void*) page2pa(page), PAGE_SIZE);
-    releaseLock(&cowBufferLock);
+    bcopy((void *)pa, (void *)page2pa(page), PAGE_SIZE);
+    pageInsert(pgdir, badAddr, page2pa(page), perm);
 }
 
 // Look up a virtual address, return the physical address,
@@ -230,7 +646,8 @@ u64 vir2phy(u64* pagetable, u64 va, int* cow) {
     if (va >= MAXVA)
         return NULL;
 
-    int ret = pageWalk(pagetable, va, 0, &pte);
+    int leaf;
+    int ret = pageWalk(pagetable, va, 0, false, &pte, &leaf);
     if (ret < 0) {
         panic("pageWalk error in vir2phy function!");
     }
@@ -242,7 +659,7 @@ u64 vir2phy(u64* pagetable, u64 va, int* cow) {
         return NULL;
     if (cow)
         *cow = (*pte & PTE_COW) > 0;
-    pa = PTE2PA(*pte) + (va&0xfff);
+    pa = PTE2PA(*pte) + (va & (PAGE_LEVEL_SIZE(leaf) - 1));
     return pa;
 }
 
@@ -1,27 +1,43 @@
 #include <Futex.h>
 #include <Process.h>
 #include <Thread.h>
+#include <Hart.h>
+#include <Riscv.h>
+#include <Error.h>
 
 typedef struct FutexQueue
 {
     u64 addr;
     Thread* thread;
     u8 valid;
+    u8 timed;   // the thread is also on the timer heap
 } FutexQueue;
 
 FutexQueue futexQueue[FUTEX_COUNT];
+// Guards futexQueue and the state of the threads in it. Taken before
+// timerLock, never inside it.
+static struct Spinlock futexLock;
 
-void futexWait(u64 addr, Thread* th, TimeSpec* ts) {
+void futexInit() {
+    initLock(&futexLock, "futex");
+}
+
+void futexWait(u64 addr, Thread* th, NanoTimeSpec* ts) {
+    acquireLock(&futexLock);
     for (int i = 0; i < FUTEX_COUNT; i++) {
         if (!futexQueue[i].valid) {
             futexQueue[i].valid = true;
             futexQueue[i].addr = addr;
             futexQueue[i].thread = th;
+            futexQueue[i].timed = ts != NULL;
+            // a waker needs futexLock, so it sees the thread asleep
+            th->state = SLEEPING;
             if (ts) {
-                th->awakeTime = ts->second * 1000000 + ts->microSecond;
-            } else {
-                th->state = SLEEPING;
+                // futexWake() sets 0 if it comes first
+                getHartTrapFrame()->a0 = -ETIMEDOUT;
+                timerAdd(th, r_time() + nanoTimeTicks(ts));
             }
+            releaseLock(&futexLock);
             yield();
             // not reach here!!!
         }
@@ -29,24 +45,36 @@ void futexWait(u64 addr, Thread* th, TimeSpec* ts) {
     panic("No futex Resource!\n");
 }
 
+// Wake the waiter in entry i. A timed one that timerPoll() already took
+// off the heap is left to it: it times out and drops the entry itself.
+// caller holds futexLock
+static bool futexWakeEntry(int i) {
+    Thread *th = futexQueue[i].thread;
+    if (futexQueue[i].timed && !timerCancel(th)) {
+        return false;
+    }
+    futexQueue[i].valid = false;
+    th->state = RUNNABLE;
+    th->trapframe.a0 = 0; // set next yield accept!
+    threadEnqueue(th);
+    return true;
+}
+
 void futexWake(u64 addr, int n) {
+    acquireLock(&futexLock);
     for (int i = 0; i < FUTEX_COUNT && n; i++) {
-        if (futexQueue[i].valid && futexQueue[i].addr == addr) {
-            futexQueue[i].thread->state = RUNNABLE;
-            futexQueue[i].thread->trapframe.a0 = 0; // set next yield accept!
-            futexQueue[i].valid = false;
+        if (futexQueue[i].valid && futexQueue[i].addr == addr && futexWakeEntry(i)) {
             n--;
         }
     }
+    releaseLock(&futexLock);
     //yield();
 }
 
 void futexRequeue(u64 addr, int n, u64 newAddr) {
+    acquireLock(&futexLock);
     for (int i = 0; i < FUTEX_COUNT && n; i++) {
-        if (futexQueue[i].valid && futexQueue[i].addr == addr) {
-            futexQueue[i].thread->state = RUNNABLE;
-            futexQueue[i].thread->trapframe.a0 = 0; // set next yield accept!
-            futexQueue[i].valid = false;
+        if (futexQueue[i].valid && futexQueue[i].addr == addr && futexWakeEntry(i)) {
             n--;
         }
     }
@@ -55,12 +83,15 @@ void futexRequeue(u64 addr, int n, u64 newAddr) {
             futexQueue[i].addr = newAddr;
         }
     }
+    releaseLock(&futexLock);
 }
 
 void futexClear(Thread* thread) {
+    acquireLock(&futexLock);
     for (int i = 0; i < FUTEX_COUNT; i++) {
         if (futexQueue[i].valid && futexQueue[i].thread == thread) {
             futexQueue[i].valid = false;
         }
     }
-}
\ No newline at end of file
+    releaseLock(&futexLock);
+}
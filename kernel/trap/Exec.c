@@ -12,6 +12,8 @@
 #include <Sysfile.h>
 #include <uapi/linux/auxvec.h>
 #include <Mmap.h>
+#include <Asid.h>
+#include <Kmalloc.h>
 
 #define MAXARG 32  // max exec arguments
 
@@ -26,6 +28,8 @@ static int loadSegment(u64* pagetable, u64 va, u64 segmentSize, struct dirent* d
     u64* entry;
     u64 i;
     int r = 0;    
+    TlbGather gather;
+    tlbGatherBegin(&gather, pagetable);
     if (offset > 0) {
         page = pa2page(pageLookup(pagetable, va, &entry));
         if (page == NULL) {
@@ -41,7 +45,8 @@ static int loadSegment(u64* pagetable, u64 va, u64 segmentSize, struct dirent* d
     }
 
     for (i = r; i < binSize; i += r) {
-        if (pageAlloc(&page) != 0) {
+        // a page the file fills completely needs no zeroing
+        if (pageAllocFlags(&page, binSize - i >= PAGE_SIZE ? 0 : PAGE_ALLOC_ZERO) != 0) {
             panic("load segment error when we need to alloc a page 1!\n");
         }
         pageInsert(pagetable, va + i, page2pa(page), PTE_EXECUTE | PTE_READ | PTE_WRITE | PTE_USER);
@@ -70,23 +75,11 @@ static int loadSegment(u64* pagetable, u64 va, u64 segmentSize, struct dirent* d
         }
         pageInsert(pagetable, va + i, page2pa(page), PTE_EXECUTE | PTE_READ | PTE_WRITE | PTE_USER);
         r = MIN(PAGE_SIZE, segmentSize - i);
-        bzero((void*)page2pa(page), r);
     }
+    tlbGatherEnd(&gather);
     return 0;
 }
 
-/* for compat with linux interface */
-void* kmalloc(int size, int policy) {
-    if (size > PAGE_SIZE){
-        panic("Do not support kmalloc a mem which size > PAGE_SIZE");
-    }
-	PhysicalPage* p;
-    pageAlloc(&p);
-    return (void *)page2pa(p);
-}
-void kfree(void* mem) {
-    pageFree(pa2page((u64)mem));
-}
 static u64 total_mapping_size(const Phdr* phdr, int nr) {
     u64 min_addr = -1;
     u64 max_addr = 0;
@@ -291,6 +284,7 @@ int exec(char* path, char** argv) {
     u64 *pagetable = 0, *old_pagetable = 0;
     Process* p = myProcess();
     u64* oldpagetable = p->pgdir;
+    u64 oldHeapBottom = p->heapBottom;
     u64 phdr_addr = 0; // virtual address in user space, point to the program header. We will pass 'phdr_addr' to ld.so
 
     if ((de = ename(AT_FDCWD, path)) == 0) {
@@ -325,6 +319,7 @@ int exec(char* path, char** argv) {
 
     old_pagetable = p->pgdir;
     p->pgdir = pagetable;
+    p->asid = 0; // entries under the old ASID map the old image
 
     MSG_PRINT("setup");
 
@@ -400,7 +395,7 @@ int exec(char* path, char** argv) {
 
         interpreter = ename(AT_FDCWD, elf_interpreter);
 
-        // kfree(elf_interpreter);
+        kfree(elf_interpreter);
         if (interpreter == NULL)
             panic("open interpreter error!");
 
@@ -424,8 +419,8 @@ int exec(char* path, char** argv) {
                                     interp_elf_phdata);
         interp_load_addr = elf_entry;
         elf_entry += interp_elf_ex->entry;
-        // kfree(interp_elf_ex);
-        // kfree(interp_elf_phdata);
+        kfree(interp_elf_ex);
+        kfree(interp_elf_phdata);
     } else {
         elf_entry = elf.entry;
     }
@@ -588,13 +583,19 @@ int exec(char* path, char** argv) {
     getHartTrapFrame()->epc = elf_entry;  // initial program counter = main
     getHartTrapFrame()->sp = sp;          // initial stack pointer
 
-    //free old pagetable
-    pgdirFree(oldpagetable);
+    //free old pagetable, unless it was borrowed by vfork
+    if (p->vforkParent) {
+        vforkRelease(p, oldHeapBottom);
+    } else {
+        pgdirFree(oldpagetable);
+    }
     asm volatile("fence.i");
     return argc;  // this ends up in a0, the first argument to main(argc, argv)
 
 bad:
     p->pgdir = old_pagetable;
+    p->heapBottom = oldHeapBottom;
+    p->asid = 0;
     if (pagetable)
         pgdirFree((u64*)pagetable);
     if (de) {
@@ -627,7 +628,7 @@ u64 sys_exec(void) {
             break;
         }
         PhysicalPage *page;
-        if(pageAlloc(&page))
+        if(pageAllocFlags(&page, 0))
             goto bad;
         argv[i] = (char *)page2pa(page);
         if (argv[i] == 0)
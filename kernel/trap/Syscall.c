@@ -10,12 +10,17 @@
 #include <exec.h>
 #include <Signal.h>
 #include <Socket.h>
+#include <Asid.h>
 #include <Mmap.h>
 #include <Futex.h>
+#include <Yield.h>
+#include <Error.h>
 #include <Thread.h>
 #include <Clone.h>
 #include <Resource.h>
 #include <FileSystem.h>
+#include <bio.h>
+#include <BlockQueue.h>
 
 void (*syscallVector[])(void) = {
     [SYSCALL_PUTCHAR]           syscallPutchar,
@@ -36,6 +41,7 @@ void (*syscallVector[])(void) = {
     [SYSCALL_GET_CPU_TIMES]     syscallGetCpuTimes,
     [SYSCALL_GET_TIME_OF_DAY]   syscallGetTime,
     [SYSCALL_SLEEP_TIME]        syscallSleepTime,
+    [SYSCALL_CLOCK_NANOSLEEP]   syscallClockNanosleep,
     [SYSCALL_DUP3]              syscallDupAndSet,
     [SYSCALL_fcntl]             syscall_fcntl,
     [SYSCALL_CHDIR]             syscallChangeDir,
@@ -85,10 +91,15 @@ void (*syscallVector[])(void) = {
     [SYSCALL_STATE_FS] syscallStateFileSystem,
     [SYSCALL_PREAD] syscallPRead,
     [SYSCALL_UTIMENSAT] syscallUtimensat,
+    [SYSCALL_SYNC] syscallSync,
+    [SYSCALL_FSYNC] syscallFileSync,
     [SYSCALL_GET_USER_ID] syscallGetUserId,
     [SYSCALL_GET_EFFECTIVE_USER_ID] syscallGetEffectiveUserId,
     [SYSCALL_MEMORY_BARRIER] syscallMemoryBarrier,
-    [SYSCALL_SIGNAL_RETURN] syscallSignalReturn
+    [SYSCALL_SIGNAL_RETURN] syscallSignalReturn,
+    [SYSCALL_SET_PRIORITY] syscallSetPriority,
+    [SYSCALL_GET_PRIORITY] syscallGetPriority,
+    [SYSCALL_KERNEL_STAT] syscallKernelStat
 };
 
 extern struct Spinlock printLock;
@@ -120,7 +131,41 @@ void syscallWait() {
 
 void syscallYield() {
     kernelProcessCpuTimeEnd();
-	yield();
+	scheduleYield();
+}
+
+#define PRIO_PROCESS 0
+
+// setpriority(PRIO_PROCESS, pid, nice), nice is clamped to its range
+void syscallSetPriority() {
+    Trapframe *tf = getHartTrapFrame();
+    int nice = (int)tf->a2;
+    Process *p;
+    if (tf->a0 != PRIO_PROCESS) {
+        tf->a0 = -EINVAL;
+        return;
+    }
+    if (pid2Process(tf->a1, &p, true) < 0) {
+        tf->a0 = -ESRCH;
+        return;
+    }
+    p->nice = nice < NICE_MIN ? NICE_MIN : (nice > NICE_MAX ? NICE_MAX : nice);
+    tf->a0 = 0;
+}
+
+// like linux, returns 20 - nice so that it is never negative
+void syscallGetPriority() {
+    Trapframe *tf = getHartTrapFrame();
+    Process *p;
+    if (tf->a0 != PRIO_PROCESS) {
+        tf->a0 = -EINVAL;
+        return;
+    }
+    if (pid2Process(tf->a1, &p, false) < 0) {
+        tf->a0 = -ESRCH;
+        return;
+    }
+    tf->a0 = 20 - p->nice;
 }
 
 void syscallClone() {
@@ -181,13 +226,44 @@ void syscallGetTime() {
     tf->a0 = 0;
 }
 
-void syscallSleepTime() {
+// Sleep until the deadline in reqVa, relative to now unless flags has
+// TIMER_ABSTIME. Sleeps are not cut short by signals here, so the time
+// left is never written back.
+static void clockSleep(int clock, int flags, u64 reqVa) {
     Trapframe *tf = getHartTrapFrame();
-    TimeSpec ts;
-    copyin(myProcess()->pgdir, (char*)&ts, tf->a0, sizeof(TimeSpec));
-    myThread()->awakeTime = r_time() +  ts.second * 1000000 + ts.microSecond;
+    NanoTimeSpec ts;
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC) {
+        tf->a0 = -EINVAL;
+        return;
+    }
+    if (copyin(myProcess()->pgdir, (char*)&ts, reqVa, sizeof(NanoTimeSpec)) < 0) {
+        tf->a0 = -EFAULT;
+        return;
+    }
+    if (ts.nanoSecond < 0 || ts.nanoSecond >= NSEC_PER_SEC) {
+        tf->a0 = -EINVAL;
+        return;
+    }
+    u64 deadline = nanoTimeTicks(&ts);
+    if (!(flags & TIMER_ABSTIME)) {
+        deadline += r_time();
+    }
+    tf->a0 = 0;
+    if (deadline <= r_time()) {
+        return;
+    }
     kernelProcessCpuTimeEnd();
-    yield();
+    timerSleep(deadline);
+}
+
+void syscallSleepTime() {
+    Trapframe *tf = getHartTrapFrame();
+    clockSleep(CLOCK_MONOTONIC, 0, tf->a0);
+}
+
+void syscallClockNanosleep() {
+    Trapframe *tf = getHartTrapFrame();
+    clockSleep(tf->a0, tf->a1, tf->a2);
 }
 
 void syscallBrk() {
@@ -228,13 +304,27 @@ void syscallUnMapMemory() {
     Trapframe *trapframe = getHartTrapFrame();
     u64 start = trapframe->a0, len = trapframe->a1, end = start + len;
     start = DOWN_ALIGN(start, 12);
+    TlbGather gather;
+    tlbGatherBegin(&gather, myProcess()->pgdir);
     while (start < end) {
+        u64 size = pageMappingSize(myProcess()->pgdir, start);
+        // a megapage goes in one piece unless the range only covers part of it
+        if (size > PGSIZE && (PAGE_OFFSET(start, size) || start + size > end)) {
+            if (pageSplit(myProcess()->pgdir, start) < 0) {
+                tlbGatherEnd(&gather);
+                trapframe->a0 = -1;
+                return ;
+            }
+            size = PGSIZE;
+        }
         if (pageRemove(myProcess()->pgdir, start) < 0) {
+            tlbGatherEnd(&gather);
             trapframe->a0 = -1;
             return ;
         }
-        start += PGSIZE;
+        start += size > PGSIZE ? size : PGSIZE;
     }
+    tlbGatherEnd(&gather);
     trapframe->a0 = 0;
 }
 
@@ -406,7 +496,7 @@ void syscallFutex() {
     int op = tf->a1, val = tf->a2, userVal;
     u64 time = tf->a3;
     u64 uaddr = tf->a0, newAddr = tf->a4;
-    struct TimeSpec t;
+    NanoTimeSpec t;
     // printf("addr: %lx, op: %d, val: %d, newAddr: %lx\n", uaddr, op, val, newAddr);
     op &= (FUTEX_PRIVATE_FLAG - 1);
     switch (op)
@@ -414,7 +504,7 @@ void syscallFutex() {
         case FUTEX_WAIT:
             copyin(myProcess()->pgdir, (char*)&userVal, uaddr, sizeof(int));
             if (time) {
-                if (copyin(myProcess()->pgdir, (char*)&t, time, sizeof(struct TimeSpec)) < 0) {
+                if (copyin(myProcess()->pgdir, (char*)&t, time, sizeof(NanoTimeSpec)) < 0) {
                     panic("copy time error!\n");
                 }
             }
@@ -524,4 +614,53 @@ void syscallSignalReturn() {
     bcopy(&sc->contextRecover, tf, sizeof(Trapframe));
     signalProcessEnd(sc->signal, &thread->processing);
     signalFinish(thread, sc);
-}
\ No newline at end of file
+}
+
+// Copy the counters named by a0 to the user buffer a1, and return how
+// many bytes were copied. Per hart counters are those of hart a2. It
+// lets a test program check the caches and the scheduler from user space.
+void syscallKernelStat() {
+    Trapframe *tf = getHartTrapFrame();
+    union {
+        BufferCacheStat bcache;
+        BlockQueueStat blockQueue;
+        HugePageStat hugePage;
+        ScheduleStat schedule;
+        DirentCacheStat direntCache;
+    } stat;
+    u64 size;
+    switch (tf->a0) {
+    case KERNEL_STAT_BUFFER_CACHE:
+        bcacheStat(&stat.bcache);
+        size = sizeof(BufferCacheStat);
+        break;
+    case KERNEL_STAT_BLOCK_QUEUE:
+        blockQueueStat(&stat.blockQueue);
+        size = sizeof(BlockQueueStat);
+        break;
+    case KERNEL_STAT_HUGE_PAGE:
+        hugePageStat(&stat.hugePage);
+        size = sizeof(HugePageStat);
+        break;
+    case KERNEL_STAT_SCHEDULE:
+        if (tf->a2 >= HART_TOTAL_NUMBER) {
+            tf->a0 = -EINVAL;
+            return;
+        }
+        scheduleStat(tf->a2, &stat.schedule);
+        size = sizeof(ScheduleStat);
+        break;
+    case KERNEL_STAT_DIRENT_CACHE:
+        direntCacheStat(&stat.direntCache);
+        size = sizeof(DirentCacheStat);
+        break;
+    default:
+        tf->a0 = -EINVAL;
+        return;
+    }
+    if (copyout(myProcess()->pgdir, tf->a1, (char*)&stat, size) < 0) {
+        tf->a0 = -EFAULT;
+        return;
+    }
+    tf->a0 = size;
+}
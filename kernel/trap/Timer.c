@@ -1,15 +1,149 @@
 #include <Driver.h>
 #include <Timer.h>
 #include <Process.h>
+#include <Thread.h>
 #include <Riscv.h>
+#include <Spinlock.h>
+#include <Futex.h>
 
 static u32 ticks;
 
+// Threads in timerSleep() by deadline, the earliest at the top. A thread
+// sleeps on at most one deadline, so the heap never outgrows threads[].
+static struct Spinlock timerLock;
+static Thread *timerHeap[PROCESS_TOTAL_NUMBER];
+static int timerCount;
+
+void timerInit() {
+    initLock(&timerLock, "timer");
+    timerCount = 0;
+}
+
+static inline void heapSet(int i, Thread *th) {
+    timerHeap[i] = th;
+    th->timerIndex = i;
+}
+
+static void heapUp(int i) {
+    Thread *th = timerHeap[i];
+    while (i > 0 && timerHeap[(i - 1) / 2]->awakeTime > th->awakeTime) {
+        heapSet(i, timerHeap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heapSet(i, th);
+}
+
+static void heapDown(int i) {
+    Thread *th = timerHeap[i];
+    while (2 * i + 1 < timerCount) {
+        int child = 2 * i + 1;
+        if (child + 1 < timerCount && timerHeap[child + 1]->awakeTime < timerHeap[child]->awakeTime) {
+            child++;
+        }
+        if (timerHeap[child]->awakeTime >= th->awakeTime) {
+            break;
+        }
+        heapSet(i, timerHeap[child]);
+        i = child;
+    }
+    heapSet(i, th);
+}
+
+// caller holds timerLock
+static void heapRemove(Thread *th) {
+    int i = th->timerIndex;
+    th->timerIndex = -1;
+    if (--timerCount == i) {
+        return;
+    }
+    Thread *last = timerHeap[timerCount];
+    heapSet(i, last);
+    heapDown(i);
+    heapUp(last->timerIndex);
+}
+
+// Ask for the next interrupt at the earlier of the next tick and the
+// earliest deadline. Deadlines are in r_time(), the SBI wants real time.
 void setNextTimeout() {
-    SBI_CALL_1(SBI_SET_TIMER, r_realTime() + INTERVAL);
+    u64 now = r_time();
+    u64 next = now + INTERVAL;
+    acquireLock(&timerLock);
+    if (timerCount > 0 && timerHeap[0]->awakeTime < next) {
+        next = timerHeap[0]->awakeTime > now ? timerHeap[0]->awakeTime : now;
+    }
+    releaseLock(&timerLock);
+    SBI_CALL_1(SBI_SET_TIMER, next - (now - r_realTime()));
+}
+
+// Make every thread whose deadline passed runnable. Once off the heap
+// nothing else wakes it, see futexWake(), so its futex wait is dropped
+// here before it can run again.
+void timerPoll() {
+    u64 now = r_time();
+    while (timerCount > 0 && timerHeap[0]->awakeTime <= now) {
+        acquireLock(&timerLock);
+        Thread *th = NULL;
+        if (timerCount > 0 && timerHeap[0]->awakeTime <= now) {
+            th = timerHeap[0];
+            heapRemove(th);
+            th->awakeTime = 0;
+        }
+        releaseLock(&timerLock);
+        if (th == NULL) {
+            break;
+        }
+        futexClear(th);
+        if (th->state == SLEEPING) {
+            th->state = RUNNABLE;
+            threadEnqueue(th);
+        }
+    }
 }
 
 void timerTick() {
     ticks++;
+    timerPoll();
     setNextTimeout();
-}
\ No newline at end of file
+}
+
+// Wake th, which the caller made SLEEPING, once r_time() reaches deadline.
+void timerAdd(Thread *th, u64 deadline) {
+    acquireLock(&timerLock);
+    th->awakeTime = deadline;
+    heapSet(timerCount++, th);
+    heapUp(timerCount - 1);
+    bool first = timerHeap[0] == th;
+    releaseLock(&timerLock);
+    if (first) {
+        setNextTimeout();
+    }
+}
+
+// Sleep until r_time() reaches deadline. Like yield() it does not return,
+// so set the syscall result before calling it.
+void timerSleep(u64 deadline) {
+    Thread *th = myThread();
+    th->state = SLEEPING;
+    timerAdd(th, deadline);
+    yield();
+}
+
+// Take th off its deadline, when something else woke it or it is freed.
+// Returns false if it was not on the heap, timerPoll() may have taken it.
+bool timerCancel(Thread *th) {
+    bool found = false;
+    acquireLock(&timerLock);
+    if (th->timerIndex >= 0) {
+        heapRemove(th);
+        th->awakeTime = 0;
+        found = true;
+    }
+    releaseLock(&timerLock);
+    return found;
+}
+
+// Timer ticks in ts, rounded up so that a sleep is never cut short.
+u64 nanoTimeTicks(NanoTimeSpec *ts) {
+    return ts->second * TIMER_FREQUENCY +
+        ((u64)ts->nanoSecond * TIMER_FREQUENCY + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
@@ -11,6 +11,9 @@
 #include <Defs.h>
 #include <exec.h>
 #include <Thread.h>
+#include <Virtio.h>
+#include <Asid.h>
+#include <Yield.h>
 
 void trapInit() {
     printf("Trap init start...\n");
@@ -19,9 +22,40 @@ void trapInit() {
     // setNextTimeout();
     w_sip(0); //todo
     w_sie(r_sie() | SIE_SEIE | SIE_SSIE | SIE_STIE);
+#ifdef VIRTIO_DISK
+    // route the disk interrupt to this hart's supervisor context
+    int hart = r_tp();
+    *(u32*)(PLIC_PRIORITY + DISK_IRQ * 4) = 1;
+    *(u32*)PLIC_SENABLE(hart) |= 1 << DISK_IRQ;
+    *(u32*)PLIC_SPRIORITY(hart) = 0;
+#endif
     printf("Trap init finish!\n");
 }
 
+static void deviceInterrupt(int irq) {
+    if (irq == UART_IRQ) {
+        int c = getchar();
+        if (c != -1) {
+            consoleInterrupt(c);
+        }
+    } else if (irq == DISK_IRQ) {
+#ifdef VIRTIO_DISK
+        virtioDiskIntr();
+#endif
+    } else if (irq) {
+        panic("unexpected interrupt irq = %d\n", irq);
+    }
+    if (irq) {
+        interruptCompleted(irq);
+    }
+}
+
+// Serve a pending external interrupt from a context that runs with
+// interrupts disabled, such as the scheduler loop.
+void devicePoll() {
+    deviceInterrupt(interruptServed());
+}
+
 int trapDevice() {
     u64 scause = r_scause();
     #ifdef QEMU
@@ -32,20 +66,7 @@ int trapDevice() {
     if ((scause & SCAUSE_INTERRUPT) && 
     ((scause & SCAUSE_EXCEPTION_CODE) == SCAUSE_SUPERVISOR_EXTERNAL)) {
     #endif
-        int irq = interruptServed();
-        if (irq == UART_IRQ) {
-            int c = getchar();
-            if (c != -1) {
-                consoleInterrupt(c);
-            }
-        } else if (irq == DISK_IRQ) {
-            // todo
-        } else if (irq) {
-            panic("unexpected interrupt irq = %d\n", irq);
-        }
-        if (irq) {
-            interruptCompleted(irq);
-        }
+        deviceInterrupt(interruptServed());
         #ifndef QEMU
         // todo
         #endif
@@ -56,6 +77,12 @@ int trapDevice() {
         timerTick();
         return TIMER_INTERRUPT;
     }
+    if ((scause & SCAUSE_INTERRUPT) &&
+    ((scause & SCAUSE_EXCEPTION_CODE) == SCAUSE_SUPERVISOR_SOFRWARE)) {
+        // another hart queued work, the scheduler looks for it next
+        w_sip(r_sip() & ~SIP_SSIP);
+        return IPI_INTERRUPT;
+    }
     return UNKNOWN_DEVICE;
 }
 
@@ -63,16 +90,14 @@ void kernelTrap() {
     u64 sepc = r_sepc();
     u64 sstatus = r_sstatus();
     u64 scause = r_scause();
-    u64 hartId = r_hartid();
-    printf("[Kernel Trap] hartId is %lx, status is %lx, spec is %lx, cause is %lx, stval is %lx\n", hartId, sstatus, sepc, scause, r_stval());
 
+    // idle harts take their interrupts here, keep it quiet
 #ifdef CJY_DEBUG
+    u64 hartId = r_hartid();
     printf("[Kernel Trap] hartId is %lx, status is %lx, spec is %lx, cause is %lx, stval is %lx\n", hartId, sstatus, sepc, scause, r_stval());
+    trapframeDump(getHartTrapFrame());
 #endif
 
-    Trapframe* trapframe = getHartTrapFrame();
-
-    trapframeDump(trapframe);
     if (!(sstatus & SSTATUS_SPP)) {
         panic("kernel trap not from supervisor mode");
     }
@@ -82,12 +107,14 @@ void kernelTrap() {
     
     int device = trapDevice();
     if (device == UNKNOWN_DEVICE) {
+        trapframeDump(getHartTrapFrame());
         u64* pte;
         int pa = pageLookup(myProcess()->pgdir, r_stval(), &pte);
         panic("unhandled error %d,  %lx, %lx\n", scause, r_stval(), pa);
         panic("kernel trap");
     }
-    if (device == TIMER_INTERRUPT) {
+    // an idle hart goes back to its scheduler loop by itself
+    if (device == TIMER_INTERRUPT && myThread() != NULL) {
         yield();
     }
     w_sepc(sepc);
@@ -105,6 +132,7 @@ void userTrap() {
     u64 sstatus = r_sstatus();
     u64 scause = r_scause();
     Process* current = myProcess();
+    kernelTlbSync();
     // int hartId = r_hartid();
     // printf("[User Trap] hartId is %lx, status is %lx, spec is %lx, cause is %lx, stval is %lx, a7 is %d\n", 
     //    hartId, sstatus, sepc, scause, r_stval(), getHartTrapFrame()->a7);
@@ -121,7 +149,9 @@ void userTrap() {
     Trapframe* trapframe = getHartTrapFrame();
     if (scause & SCAUSE_INTERRUPT) {
         trapDevice();
-        yield();
+        if (schedulePreempt()) {
+            yield();
+        }
     } else {
         kernelProcessCpuTimeBegin();
         u64 *pte = NULL;
@@ -189,7 +219,8 @@ void userTrapReturn() {
     sstatus &= ~SSTATUS_SPP;
     sstatus |= SSTATUS_SPIE;
     w_sstatus(sstatus);
-    u64 satp = MAKE_SATP(current->pgdir);
+    bool flush;
+    u64 satp = asidSatp(current, &flush);
     u64 fn = TRAMPOLINE_BASE + ((u64)userReturn - (u64)trampoline);
     u64* pte;
     u64 pa = pageLookup(current->pgdir, USER_STACK_TOP - PAGE_SIZE, &pte);
@@ -204,7 +235,7 @@ void userTrapReturn() {
     }
     
     // printf("return to user!\n");
-    ((void(*)(u64, u64))fn)((u64)trapframe, satp);
+    ((void(*)(u64, u64, u64))fn)((u64)trapframe, satp, flush);
 }
 
 void trapframeDump(Trapframe *tf)
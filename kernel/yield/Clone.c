@@ -3,9 +3,9 @@
 #include <Process.h>
 #include <Page.h>
 
-extern struct Spinlock scheduleListLock;
-extern struct ThreadList scheduleList[2];
-int processFork() {
+// Make a child process of the caller that returns to user mode where
+// the caller does, with a0 = 0 and its own references to the open files.
+static int processChild(Thread **child) {
     Thread* thread;
     Process* process, *current = myProcess();
     int r = mainThreadAlloc(&thread, current->processId);
@@ -18,44 +18,80 @@ int processFork() {
         if (current->ofile[i])
             process->ofile[i] = filedup(current->ofile[i]);
     process->priority = current->priority;
+    process->nice = current->nice;
+    process->heapBottom = current->heapBottom;
     Trapframe* trapframe = getHartTrapFrame();
     bcopy(trapframe, &thread->trapframe, sizeof(Trapframe));
     thread->trapframe.a0 = 0;
     thread->trapframe.kernelSp = getThreadTopSp(thread);
-    u64 i, j, k;
-    for (i = 0; i < 512; i++) {
-        if (!(current->pgdir[i] & PTE_VALID)) {
-            continue;
-        }
-        u64 *pa = (u64*) PTE2PA(current->pgdir[i]);
-        for (j = 0; j < 512; j++) {
-            if (!(pa[j] & PTE_VALID)) {
-                continue;
-            }
-            u64 *pa2 = (u64*) PTE2PA(pa[j]);
-            for (k = 0; k < 512; k++) {
-                if (!(pa2[k] & PTE_VALID)) {
-                    continue;
-                }
-                u64 va = (i << 30) + (j << 21) + (k << 12);
-                // printf("Fork va addr is %lx\n", va);
-                if (va == TRAMPOLINE_BASE || va == TRAMPOLINE_BASE + PAGE_SIZE) {
-                    continue;
-                }
-                if (pa2[k] & PTE_WRITE) {
-                    pa2[k] |= PTE_COW;
-                    pa2[k] &= ~PTE_WRITE;
-                } 
-                pageInsert(process->pgdir, va, PTE2PA(pa2[k]), PTE2PERM(pa2[k]));
-            }
-        }
+    *child = thread;
+    return 0;
+}
+
+int processFork() {
+    Thread* thread;
+    int r = processChild(&thread);
+    if (r < 0) {
+        return r;
     }
-    acquireLock(&scheduleListLock);
-    LIST_INSERT_TAIL(&scheduleList[0], thread, scheduleLink);
-    releaseLock(&scheduleListLock);
+    Process* process = thread->process;
+    r = pgdirFork(process->pgdir, myProcess()->pgdir);
+    if (r < 0) {
+        mainThreadFree(thread);
+        return r;
+    }
+    threadEnqueue(thread);
     return process->processId;
 }
 
+// CLONE_VM | CLONE_VFORK: the child runs in the caller's address space,
+// on stackVa if given, and the caller sleeps until the child execs or
+// exits. Nothing is copied, so spawning costs the same for any parent.
+// Another thread of the caller could exit meanwhile and free the page
+// table under the child, so a multithreaded caller gets a copy instead.
+int processVfork(u32 flags, u64 stackVa, u64 tls) {
+    Thread* thread;
+    Process* current = myProcess();
+    int r = processChild(&thread);
+    if (r < 0) {
+        return r;
+    }
+    Process* process = thread->process;
+    if (stackVa) {
+        thread->trapframe.sp = stackVa;
+    }
+    if (flags & CLONE_SETTLS) {
+        thread->trapframe.tp = tls;
+    }
+    u32 processId = process->processId;
+
+    acquireLock(&current->lock);
+    int threadCount = current->threadCount;
+    releaseLock(&current->lock);
+    if (threadCount > 1) {
+        r = pgdirFork(process->pgdir, current->pgdir);
+        if (r < 0) {
+            mainThreadFree(thread);
+            return r;
+        }
+        threadEnqueue(thread);
+        return processId;
+    }
+
+    pgdirFree(process->pgdir);
+    process->pgdir = current->pgdir;
+    process->vforkParent = current;
+
+    threadEnqueue(thread);
+
+    acquireLock(&process->lock);
+    while (process->vforkParent == current) {
+        sleep(&process->vforkParent, &process->lock);
+    }
+    releaseLock(&process->lock);
+    return processId;
+}
+
 int threadFork(u64 stackVa, u64 ptid, u64 tls, u64 ctid) {
     Thread* thread;
     Process* current = myProcess();
@@ -73,9 +109,7 @@ int threadFork(u64 stackVa, u64 ptid, u64 tls, u64 ctid) {
         copyout(current->pgdir, ptid, (char*) &thread->id, sizeof(u32));
     }
     thread->clearChildTid = ctid;
-    acquireLock(&scheduleListLock);
-    LIST_INSERT_TAIL(&scheduleList[0], thread, scheduleLink);
-    releaseLock(&scheduleListLock);
+    threadEnqueue(thread);
     return thread->id;
 }
 
@@ -83,6 +117,8 @@ int clone(u32 flags, u64 stackVa, u64 ptid, u64 tls, u64 ctid) {
     // printf("clone flags: %d\n", flags);
     if (flags == PROCESS_FORK) {
         return processFork();
+    } else if ((flags & (CLONE_VM | CLONE_VFORK)) == (CLONE_VM | CLONE_VFORK)) {
+        return processVfork(flags, stackVa, tls);
     } else {
         return threadFork(stackVa, ptid, tls, ctid);
     }
@@ -50,6 +50,7 @@ void processInit() {
     int i;
     // extern u64 kernelPageDirectory[];
     for (i = PROCESS_TOTAL_NUMBER - 1; i >= 0; i--) {
+        waitQueueInit(&processes[i].childExit, "childExit");
         LIST_INSERT_HEAD(&freeProcesses, &processes[i], link);
     }
 
@@ -66,9 +67,28 @@ u32 generateProcessId(Process *p) {
     return processId;
 }
 
+// A vfork child gives the borrowed address space back when it execs or
+// exits: the parent takes over the heap break it left and runs again.
+// The child changed the page table under its own ASID, and its flushes
+// never reached the parent's, so every hart that ran the parent flushes
+// the parent's ASID before running it again.
+void vforkRelease(Process *p, u64 heapBottom) {
+    Process *parent = p->vforkParent;
+    parent->heapBottom = heapBottom;
+    __sync_fetch_and_or(&parent->asidStale, parent->asidHarts);
+    acquireLock(&p->lock);
+    p->vforkParent = NULL;
+    wakeup(&p->vforkParent);
+    releaseLock(&p->lock);
+}
+
 void processFree(Process *p) {
     // printf("[%lx] free env %lx\n", currentProcess[r_hartid()] ? currentProcess[r_hartid()]->id : 0, p->id);
-    pgdirFree(p->pgdir);
+    if (p->vforkParent) {
+        vforkRelease(p, p->heapBottom);
+    } else {
+        pgdirFree(p->pgdir);
+    }
     p->state = ZOMBIE; // new
     for (int fd = 0; fd < NOFILE; fd++) {
         if (p->ofile[fd]) {
@@ -85,13 +105,34 @@ void processFree(Process *p) {
         //     panic("Can't get parent process, current process is %x, parent is %x\n", p->id, p->parentId);
         // }
         // printf("[Free] process %x wake up %x\n", p->id, parentProcess);
-        // The parent process may die before the child process
+        // The parent process may die before the child process.
+        // Holding waitLock, the parent is either asleep already or
+        // has yet to look at our state.
         if (r == 0) {
-            wakeup(parentProcess);
+            acquireLock(&waitLock);
+            waitQueueWakeup(&parentProcess->childExit);
+            releaseLock(&waitLock);
         }
     }
 }
 
+// Give back a process from processAlloc() that never ran, as when a
+// fork fails half way. Unlike processFree() no parent is told about it.
+void processDiscard(Process *p) {
+    pgdirFree(p->pgdir);
+    for (int fd = 0; fd < NOFILE; fd++) {
+        if (p->ofile[fd]) {
+            fileclose(p->ofile[fd]);
+            p->ofile[fd] = 0;
+        }
+    }
+    acquireLock(&freeProcessesLock);
+    p->state = UNUSED;
+    p->parentId = 0;
+    LIST_INSERT_HEAD(&freeProcesses, p, link);
+    releaseLock(&freeProcessesLock);
+}
+
 int pid2Process(u32 processId, struct Process **process, int checkPerm) {
     struct Process* p;
     // int hartId = r_hartid();
@@ -131,6 +172,9 @@ int processSetup(Process *p) {
     }
     
     p->pgdir = (u64*) page2pa(page);
+    p->asid = 0;
+    p->vforkParent = NULL;
+    p->nice = 0;
     p->retValue = 0;
     p->state = UNUSED;
     p->parentId = 0;
@@ -201,7 +245,7 @@ int codeMapper(u64 va, u32 segmentSize, u8 *binary, u32 binSize, void *userData)
         bcopy(binary, (void*) page2pa(p) + offset, r);
     }
     for (i = r; i < binSize; i += r) {
-        if (pageAlloc(&p) != 0) {
+        if (pageAllocFlags(&p, binSize - i >= PAGE_SIZE ? 0 : PAGE_ALLOC_ZERO) != 0) {
             return -1;
         }
         pageInsert(process->pgdir, va + i, page2pa(p), 
@@ -230,13 +274,10 @@ int codeMapper(u64 va, u32 segmentSize, u8 *binary, u32 binSize, void *userData)
         pageInsert(process->pgdir, va + i, page2pa(p), 
             PTE_EXECUTE | PTE_READ | PTE_WRITE | PTE_USER);
         r = MIN(PAGE_SIZE, segmentSize - i);
-        bzero((void*) page2pa(p), r);
     }
     return 0;
 }
 
-extern struct Spinlock scheduleListLock;
-extern struct ThreadList scheduleList[2];
 void processCreatePriority(u8 *binary, u32 size, u32 priority) {
     Thread* th;
     int r = mainThreadAlloc(&th, 0);
@@ -251,9 +292,7 @@ void processCreatePriority(u8 *binary, u32 size, u32 priority) {
     }
     th->trapframe.epc = entryPoint;
 
-    acquireLock(&scheduleListLock);
-    LIST_INSERT_TAIL(&scheduleList[0], th, scheduleLink);
-    releaseLock(&scheduleListLock);
+    threadEnqueue(th);
 }
 
 static inline void updateAncestorsCpuTime(Process *p) {
@@ -304,7 +343,7 @@ int wait(int targetProcessId, u64 addr) {
         }
 
         // printf("[WAIT]porcess id %x wait for %x\n", p->id, p);
-        sleep(p, &waitLock);
+        waitQueueSleep(&p->childExit, &waitLock);
     }
 }
 
@@ -9,14 +9,14 @@
 #include <Process.h>
 #include <Trap.h>
 #include <Futex.h>
+#include <Yield.h>
 
 Thread threads[PROCESS_TOTAL_NUMBER];
 
 static struct ThreadList freeThreades;
-struct ThreadList scheduleList[2];
 Thread *currentThread[HART_TOTAL_NUMBER] = {0};
 
-struct Spinlock freeThreadListLock, scheduleListLock, threadIdLock;
+struct Spinlock freeThreadListLock, threadIdLock;
 
 Thread* myThread() {
     interruptPush();
@@ -38,16 +38,20 @@ u64 getThreadTopSp(Thread* th) {
 extern u64 kernelPageDirectory[];
 void threadInit() {
     initLock(&freeThreadListLock, "freeThread");
-    initLock(&scheduleListLock, "scheduleList");
     initLock(&threadIdLock, "threadId");
 
     LIST_INIT(&freeThreades);
-    LIST_INIT(&scheduleList[0]);
-    LIST_INIT(&scheduleList[1]);
+    scheduleInit();
+    waitTableInit();
+    timerInit();
+    futexInit();
 
     int i;
     for (i = PROCESS_TOTAL_NUMBER - 1; i >= 0; i--) {
         threads[i].state = UNUSED;
+        threads[i].queued = threads[i].onHart = 0;
+        threads[i].hart = -1;
+        threads[i].timerIndex = -1;
         threads[i].trapframe.kernelSatp = MAKE_SATP(kernelPageDirectory);
         LIST_INSERT_HEAD(&freeThreades, &threads[i], link);
     }
@@ -70,12 +74,15 @@ void threadDestroy(Thread *th) {
         extern char kernelStack[];
         u64 sp = (u64)kernelStack + (hartId + 1) * KERNEL_STACK_SIZE;
         asm volatile("ld sp, 0(%0)" : :"r"(&sp): "memory");
+        // off its stack now, so it may be handed out again
+        th->onHart = 0;
         yield();
     }
 }
 
 void threadFree(Thread *th) {
     Process* p = th->process;
+    timerCancel(th);
     acquireLock(&th->lock);
     while (!LIST_EMPTY(&th->waitingSignal)) {
         SignalContext* sc = LIST_FIRST(&th->waitingSignal);
@@ -104,6 +111,17 @@ void threadFree(Thread *th) {
     releaseLock(&freeThreadListLock);
 }
 
+// Undo mainThreadAlloc() for a thread that never ran, with its process
+// and kernel stack page.
+void mainThreadFree(Thread *th) {
+    processDiscard(th->process);
+    pageRemove(kernelPageDirectory, getThreadTopSp(th) - PAGE_SIZE);
+    acquireLock(&freeThreadListLock);
+    th->state = UNUSED;
+    LIST_INSERT_HEAD(&freeThreades, th, link);
+    releaseLock(&freeThreadListLock);
+}
+
 int tid2Thread(u32 threadId, struct Thread **thread, int checkPerm) {
     struct Thread* th;
     int hartId = r_hartid();
@@ -142,6 +160,9 @@ void threadSetup(Thread* th) {
     th->setChildTid = th->clearChildTid = 0;
     th->awakeTime = 0;
     th->robustHeadPointer = 0;
+    th->tlbGather = NULL;
+    th->hart = -1;
+    th->vruntime = 0;
     LIST_INIT(&th->waitingSignal);
     PhysicalPage *page;
     if (pageAlloc(&page) < 0) {
@@ -238,6 +259,7 @@ void threadRun(Thread* th) {
             strncpy(rootFileSystem.name, "fat32", 6);
             
             rootFileSystem.read = blockRead;
+            rootFileSystem.prefetch = blockPrefetch;
             fatInit(&rootFileSystem);
             initDirentCache();
             void testfat();
@@ -285,52 +307,3 @@ void threadRun(Thread* th) {
         userTrapReturn();
     }
 }
-
-void sleepSave();
-void sleep(void* chan, struct Spinlock* lk) { 
-    Thread* th = myThread();
-
-    // Must acquire p->lock in order to
-    // change p->state and then call sched.
-    // Once we hold p->lock, we can be
-    // guaranteed that we won't miss any wakeup
-    // (wakeup locks p->lock),
-    // so it's okay to release lk.
-
-    kernelProcessCpuTimeEnd();
-    acquireLock(&th->lock);  // DOC: sleeplock1
-    releaseLock(lk);
-
-    // Go to sleep.
-    th->chan = (u64)chan;
-    th->state = SLEEPING;
-    th->reason = KERNEL_GIVE_UP;
-    releaseLock(&th->lock);
-
-	asm volatile("sd sp, 0(%0)" : :"r"(&th->currentKernelSp));
-
-    sleepSave();
-
-    // // Tidy up.
-    acquireLock(&th->lock);  // DOC: sleeplock1
-    th->chan = 0;
-    releaseLock(&th->lock);
-
-    kernelProcessCpuTimeBegin();
-
-    // Reacquire original lock.
-    acquireLock(lk);
-}
-
-void wakeup(void* channel) {
-    for (int i = 0; i < PROCESS_TOTAL_NUMBER; ++i) {
-        if (&threads[i] != myThread()) {
-            acquireLock(&threads[i].lock);
-            if (threads[i].state == SLEEPING && threads[i].chan == (u64)channel) {
-                threads[i].state = RUNNABLE;
-            }
-            releaseLock(&threads[i].lock);
-        }
-    }
-}
-
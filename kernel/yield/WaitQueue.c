@@ -0,0 +1,90 @@
+#include <WaitQueue.h>
+#include <Thread.h>
+#include <Process.h>
+#include <Riscv.h>
+
+// sleep() and wakeup() on a bare channel use the queue it hashes to, so
+// different channels can share a queue and wakeup() checks th->chan.
+static WaitQueue waitTable[WAIT_TABLE_SIZE];
+
+void waitQueueInit(WaitQueue *wq, char *name) {
+    initLock(&wq->lock, name);
+    LIST_INIT(&wq->waiters);
+}
+
+void waitTableInit() {
+    for (int i = 0; i < WAIT_TABLE_SIZE; i++) {
+        waitQueueInit(&waitTable[i], "waitTable");
+    }
+}
+
+static inline WaitQueue *waitTableQueue(void *chan) {
+    u64 hash = ((u64)chan >> 3) * 0x9e3779b97f4a7c15UL;
+    return &waitTable[hash >> (64 - WAIT_TABLE_SHIFT)];
+}
+
+void sleepSave();
+// Sleep in wq until woken, releasing lk meanwhile. lk is held when
+// calling and when returning, and may be wq->lock itself. A waker
+// needs wq->lock, and it is taken before lk is let go, so no wakeup
+// can be missed.
+static void sleepOn(WaitQueue *wq, u64 chan, struct Spinlock *lk) {
+    Thread *th = myThread();
+
+    kernelProcessCpuTimeEnd();
+    if (lk != &wq->lock) {
+        acquireLock(&wq->lock);
+        releaseLock(lk);
+    }
+
+    th->chan = chan;
+    th->state = SLEEPING;
+    th->reason = KERNEL_GIVE_UP;
+    LIST_INSERT_HEAD(&wq->waiters, th, waitLink);
+    releaseLock(&wq->lock);
+
+    asm volatile("sd sp, 0(%0)" : :"r"(&th->currentKernelSp));
+
+    sleepSave();
+
+    kernelProcessCpuTimeBegin();
+    acquireLock(lk);
+}
+
+// Wake at most n threads of wq sleeping on chan, every one if n < 0.
+static void wakeOn(WaitQueue *wq, u64 chan, int n) {
+    Thread *th, *next;
+    acquireLock(&wq->lock);
+    for (th = LIST_FIRST(&wq->waiters); th != NULL && n != 0; th = next) {
+        next = LIST_NEXT(th, waitLink);
+        if (th->chan != chan) {
+            continue;
+        }
+        LIST_REMOVE(th, waitLink);
+        th->chan = 0;
+        th->state = RUNNABLE;
+        threadEnqueue(th);
+        n--;
+    }
+    releaseLock(&wq->lock);
+}
+
+void waitQueueSleep(WaitQueue *wq, struct Spinlock *lk) {
+    sleepOn(wq, (u64)wq, lk);
+}
+
+void waitQueueWakeup(WaitQueue *wq) {
+    wakeOn(wq, (u64)wq, -1);
+}
+
+void waitQueueWakeupOne(WaitQueue *wq) {
+    wakeOn(wq, (u64)wq, 1);
+}
+
+void sleep(void* chan, struct Spinlock* lk) {
+    sleepOn(waitTableQueue(chan), (u64)chan, lk);
+}
+
+void wakeup(void* channel) {
+    wakeOn(waitTableQueue(channel), (u64)channel, -1);
+}
@@ -1,51 +1,322 @@
 // Thread level yield
+//
+// Every hart schedules from its own run queue. A thread made runnable by
+// fork or wakeup is queued on the hart doing it, and a hart with nothing
+// to run steals from the longest queue of another hart. Queues are kept
+// sorted by vruntime, see Yield.h.
 
 #include <Riscv.h>
 #include <Thread.h>
 #include <Page.h>
 #include <Signal.h>
 #include <Futex.h>
+#include <Trap.h>
+#include <Asid.h>
+#include <Hart.h>
+#include <Yield.h>
+#include <Driver.h>
 
-extern struct Spinlock scheduleListLock;
-extern struct ThreadList scheduleList[2];
+extern Thread *currentThread[];
 
-static int processTimeCount[HART_TOTAL_NUMBER] = {0};
-static int processBelongList[HART_TOTAL_NUMBER] = {0};
+static struct RunQueue {
+    struct Spinlock lock;
+    struct ThreadList threads;  // by vruntime, smallest first
+    int count;                  // read without the lock to pick a queue to steal from
+    u64 minVruntime;            // never goes back, new threads start here
+} runQueues[HART_TOTAL_NUMBER];
 
-void yield() {
+static ScheduleStat scheduleStats[HART_TOTAL_NUMBER];
+static bool needResched[HART_TOTAL_NUMBER];
+static volatile unsigned long idleHarts;  // harts waiting in wfi
+static u64 scheduleTimeslice = SCHEDULE_TIMESLICE;
+
+// weight of nice NICE_MIN to NICE_MAX, each step is about 10% of cpu time
+static const u32 niceWeight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+void scheduleInit() {
+    for (int i = 0; i < HART_TOTAL_NUMBER; i++) {
+        initLock(&runQueues[i].lock, "runQueue");
+        LIST_INIT(&runQueues[i].threads);
+        runQueues[i].count = 0;
+        runQueues[i].minVruntime = 0;
+    }
+}
+
+void scheduleStat(int hartId, ScheduleStat *stat) {
+    *stat = scheduleStats[hartId];
+}
+
+void scheduleSetTimeslice(u64 timeslice) {
+    scheduleTimeslice = timeslice < SCHEDULE_MIN_GRANULARITY ? SCHEDULE_MIN_GRANULARITY : timeslice;
+}
+
+u64 processWeight(Process *p) {
+    return (u64)niceWeight[p->nice - NICE_MIN] * (p->priority ? p->priority : 1);
+}
+
+u64 threadTimeslice(Thread *th) {
+    u64 slice = scheduleTimeslice * processWeight(th->process) / NICE_0_WEIGHT;
+    if (slice < SCHEDULE_MIN_GRANULARITY) {
+        return SCHEDULE_MIN_GRANULARITY;
+    }
+    return slice > 8 * scheduleTimeslice ? 8 * scheduleTimeslice : slice;
+}
+
+// Move th's vruntime from the clock of queue `from` to that of rq.
+static void vruntimeMove(Thread *th, struct RunQueue *from, struct RunQueue *rq) {
+    if (from != rq) {
+        th->vruntime = th->vruntime - from->minVruntime + rq->minVruntime;
+    }
+}
+
+// caller holds rq->lock
+static void runQueueInsert(struct RunQueue *rq, Thread *th) {
+    Thread *pos, *last = NULL;
+    LIST_FOREACH(pos, &rq->threads, scheduleLink) {
+        if ((i64)(pos->vruntime - th->vruntime) > 0) {
+            break;
+        }
+        last = pos;
+    }
+    if (last == NULL) {
+        LIST_INSERT_HEAD(&rq->threads, th, scheduleLink);
+    } else {
+        LIST_INSERT_AFTER(last, th, scheduleLink);
+    }
+    rq->count++;
+}
+
+// Send an IPI to one idle hart other than the caller, so that it can
+// steal what was just queued. The bit is cleared first, so one hart
+// is not woken twice.
+static void wakeIdleHart(int hartId) {
+    unsigned long idle = idleHarts & ~(1UL << hartId);
+    while (idle) {
+        int target = __builtin_ctzl(idle);
+        unsigned long mask = 1UL << target;
+        if (__sync_fetch_and_and(&idleHarts, ~mask) & mask) {
+            scheduleStats[hartId].wakeups++;
+            sbi_send_ipi(&mask);
+            return;
+        }
+        idle &= ~mask;
+    }
+}
+
+// Queue th on the run queue of hartId, unless it already is on one. A
+// thread that was asleep gets at most half a timeslice of credit, so it
+// runs soon without taking the hart for long.
+static void enqueueOn(Thread *th, int hartId, bool woken) {
+    if (!__sync_bool_compare_and_swap(&th->queued, 0, 1)) {
+        return;
+    }
+    struct RunQueue *rq = &runQueues[hartId];
+    acquireLock(&rq->lock);
+    if (woken) {
+        if (th->hart < 0) {
+            th->vruntime = rq->minVruntime;
+        } else {
+            vruntimeMove(th, &runQueues[th->hart], rq);
+            u64 floor = rq->minVruntime - scheduleTimeslice / 2;
+            if (rq->minVruntime > scheduleTimeslice / 2 && (i64)(th->vruntime - floor) < 0) {
+                th->vruntime = floor;
+            }
+        }
+    }
+    runQueueInsert(rq, th);
+    releaseLock(&rq->lock);
+    // pairs with the barrier in idleWait()
+    __sync_synchronize();
+    if (woken && idleHarts) {
+        wakeIdleHart(r_hartid());
+    }
+
+    Thread *current = currentThread[hartId];
+    if (woken && current != NULL &&
+        (i64)(current->vruntime - th->vruntime) > (i64)SCHEDULE_WAKEUP_GRANULARITY) {
+        needResched[hartId] = true;
+    }
+}
+
+void threadEnqueue(Thread *th) {
+    enqueueOn(th, r_hartid(), true);
+}
+
+// Take the first thread of rq. Threads that stopped being runnable
+// while queued are dropped on the way.
+static Thread *runQueuePop(struct RunQueue *rq) {
+    Thread *th, *next;
+    acquireLock(&rq->lock);
+    for (th = LIST_FIRST(&rq->threads); th != NULL; th = next) {
+        next = LIST_NEXT(th, scheduleLink);
+        LIST_REMOVE(th, scheduleLink);
+        rq->count--;
+        th->queued = 0;
+        if (th->state == RUNNABLE) {
+            if ((i64)(th->vruntime - rq->minVruntime) > 0) {
+                rq->minVruntime = th->vruntime;
+            }
+            break;
+        }
+    }
+    releaseLock(&rq->lock);
+    return th;
+}
+
+static bool workQueued() {
+    for (int i = 0; i < HART_TOTAL_NUMBER; i++) {
+        if (runQueues[i].count > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Wait in wfi until an interrupt comes. It is executed with interrupts
+// masked, as the privileged spec suggests, and wakes up on any pending
+// one enabled in sie. They are then taken by briefly turning interrupts
+// on, so nothing that arrives between the last check and wfi is lost.
+static void idleWait(int hartId) {
+    unsigned long self = 1UL << hartId;
+    __sync_fetch_and_or(&idleHarts, self);
+    __sync_synchronize();
+    if (!workQueued()) {
+        u64 start = r_time();
+        asm volatile("wfi");
+        scheduleStats[hartId].idleTime += r_time() - start;
+        intr_on();
+        intr_off();
+    }
+    __sync_fetch_and_and(&idleHarts, ~self);
+}
+
+static Thread *steal(int hartId) {
+    int victim = -1, most = 0;
+    for (int i = 0; i < HART_TOTAL_NUMBER; i++) {
+        if (i != hartId && runQueues[i].count > most) {
+            most = runQueues[i].count;
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return NULL;
+    }
+    Thread *th = runQueuePop(&runQueues[victim]);
+    if (th) {
+        vruntimeMove(th, &runQueues[victim], &runQueues[hartId]);
+        scheduleStats[hartId].steals++;
+    }
+    return th;
+}
+
+// Runs on the hart's own stack, so prev can be picked up by another
+// hart as soon as it is queued.
+static void schedule(Thread *prev) {
     int hartId = r_hartid();
-    int count = processTimeCount[hartId];
-    int point = processBelongList[hartId];
-    struct Thread* thread = myThread(); 
-    acquireLock(&scheduleListLock);
-    if (thread && thread->state == RUNNING) {
-        if(thread->reason==KERNEL_GIVE_UP){
-            bcopy(getHartTrapFrame(), &thread->trapframe, sizeof(Trapframe));
-        }
-        thread->state = RUNNABLE;
-    }
-    while ((count == 0) || !thread || (thread->state != RUNNABLE) || thread->awakeTime > r_time()) {
-        if (thread)
-            LIST_INSERT_TAIL(&scheduleList[point ^ 1], thread, scheduleLink);
-        if (LIST_EMPTY(&scheduleList[point]))
-            point ^= 1;
-        if (!(LIST_EMPTY(&scheduleList[point]))) {
-            thread = LIST_FIRST(&scheduleList[point]);
-            LIST_REMOVE(thread, scheduleLink);
-            count = 1;
-        }
-        releaseLock(&scheduleListLock);
-        acquireLock(&scheduleListLock);
-    }
-    releaseLock(&scheduleListLock);
-    count--;
-    processTimeCount[hartId] = count;
-    processBelongList[hartId] = point;
-    // printf("hartID %d yield thread %lx, the process is %lx\n", hartId, thread->id, thread->process->processId);
-    if (thread->awakeTime > 0) {
-        getHartTrapFrame()->a0 = 0;
-        thread->awakeTime = 0;
+    needResched[hartId] = false;
+    if (prev) {
+        u64 ran = r_time() - prev->runStart;
+        prev->vruntime += ran * NICE_0_WEIGHT / processWeight(prev->process);
+        if (prev->state == RUNNABLE) {
+            enqueueOn(prev, hartId, false);
+        }
+        __sync_synchronize();
+        prev->onHart = 0;
     }
+
+    Thread *thread;
+    while (true) {
+        thread = runQueues[hartId].count ? runQueuePop(&runQueues[hartId]) : NULL;
+        if (thread == NULL) {
+            thread = steal(hartId);
+        }
+        if (thread) {
+            break;
+        }
+        scheduleStats[hartId].idle++;
+        // sleepers whose deadline passed while interrupts were off
+        timerPoll();
+#ifdef VIRTIO_DISK
+        // finish a disk request without waiting for its interrupt
+        devicePoll();
+#endif
+        if (!pageZeroIdle() && runQueues[hartId].count == 0) {
+            idleWait(hartId);
+        }
+    }
+
+    // the hart it last ran on may still be leaving its stack
+    while (thread->onHart) {
+        __sync_synchronize();
+    }
+    thread->onHart = 1;
+    if (thread->hart != hartId) {
+        if (thread->hart >= 0) {
+            scheduleStats[hartId].migrations++;
+        }
+        thread->hart = hartId;
+    }
+    scheduleStats[hartId].switches++;
+    thread->runStart = r_time();
+
+    // printf("hartID %d yield thread %lx, the process is %lx\n", hartId, thread->id, thread->process->processId);
     futexClear(thread);
+    kernelTlbSync();
     threadRun(thread);
-}
\ No newline at end of file
+}
+
+// Whether the running thread should give up the hart at this interrupt:
+// it used up its timeslice, or a woken thread is far enough behind it.
+bool schedulePreempt() {
+    int hartId = r_hartid();
+    Thread *th = currentThread[hartId];
+    if (th == NULL) {
+        return true;
+    }
+    u64 ran = r_time() - th->runStart;
+    if (needResched[hartId] && ran >= SCHEDULE_MIN_GRANULARITY) {
+        return true;
+    }
+    return ran >= threadTimeslice(th);
+}
+
+// sched_yield(): go behind every thread queued on this hart, which the
+// smallest vruntime alone would not do for a thread that barely ran.
+void scheduleYield() {
+    int hartId = r_hartid();
+    Thread *th = myThread(), *pos;
+    struct RunQueue *rq = &runQueues[hartId];
+    acquireLock(&rq->lock);
+    LIST_FOREACH(pos, &rq->threads, scheduleLink) {
+        if ((i64)(pos->vruntime - th->vruntime) > 0) {
+            th->vruntime = pos->vruntime;
+        }
+    }
+    releaseLock(&rq->lock);
+    yield();
+}
+
+void yield() {
+    int hartId = r_hartid();
+    struct Thread* thread = myThread();
+    if (thread) {
+        if (thread->state == RUNNING) {
+            thread->state = RUNNABLE;
+        }
+        bcopy(getHartTrapFrame(), &thread->trapframe, sizeof(Trapframe));
+        currentThread[hartId] = NULL;
+    }
+    register u64 a0 asm("a0") = (u64)thread;
+    void (*fn)(Thread *) = schedule;
+    asm volatile("mv sp, %0\n\tjr %1" : : "r"(getHartKernelTopSp()), "r"(fn), "r"(a0) : "memory");
+    __builtin_unreachable();
+}